@@ -50,6 +50,12 @@ public:
     /** Returns true if the envelope is in its attack, decay, sustain or release stage. */
     bool isActive() const noexcept             { return currentState != State::idle; }
 
+    /** Returns true if the envelope is in its attack stage. */
+    bool isAttacking() const noexcept          { return currentState == State::attack; }
+
+    /** Returns true if the envelope is in its release stage. */
+    bool isReleasing() const noexcept          { return currentState == State::release; }
+
     //==============================================================================
     /** Sets the sample rate that will be used for the envelope.
 
@@ -4,7 +4,11 @@
 void rmpReverb::applyOn(AudioBuffer<float> &buffer, int startSample, int numSamples)
 {
     if (std::get<TupleValues::currentValue>(params["turnedOn"]) == 0)
+    {
+        // a switched off effect adds nothing, whatever was still ringing in it
+        tailSamplesLeft = 0;
         return;
+    }
 
     if (numSamples == -1)
         numSamples = buffer.getNumSamples();
@@ -19,29 +23,47 @@ void rmpReverb::applyOn(AudioBuffer<float> &buffer, int startSample, int numSamp
 	float* input[2] = { l_channel , r_channel };
 	
 	mreverb.process(input, input, numSamples);
+    trackTail(buffer, startSample, numSamples, tailHold);
 
 }
 
 void rmpADSR::applyOn(AudioBuffer<float> &buffer, int startSample, int numSamples)
 {
-
-    if (prevBufferStatus == true && !adsr.isActive())
-        delayedFinish();
-    prevBufferStatus = adsr.isActive();
-
-    if (std::get<TupleValues::currentValue>(params["turnedOn"]) == 0)
-        return;
-
-    adsr.applyEnvelopeToBuffer(buffer, startSample, numSamples);
+    if (std::get<TupleValues::currentValue>(params["turnedOn"]) != 0)
+        adsr.applyEnvelopeToBuffer(buffer, startSample, numSamples);
+    else if (adsr.isReleasing())
+    {
+        // switching the envelope off ends a pending release instead of letting the raw sample through
+        adsr.reset();
+        buffer.clear(startSample, numSamples);
+    }
+    reportStage();
 }
 
 void rmpVolume::applyOn(AudioBuffer<float> &buffer, int startSample, int numSamples)
 {
-    buffer.applyGain(startSample, numSamples, getParamValue("value"));
+    gain.applyGain(buffer, startSample, numSamples);
 }
 
 void rmpPan::applyOn(AudioBuffer<float> &buffer, int startSample, int numSamples)
 {
-    buffer.applyGain(0, startSample, numSamples, 1 - getParamValue("value"));
-    buffer.applyGain(1, startSample, numSamples, getParamValue("value"));
+    if (!pan.isSmoothing())
+    {
+        buffer.applyGain(0, startSample, numSamples, 1 - pan.getCurrentValue());
+        buffer.applyGain(1, startSample, numSamples, pan.getCurrentValue());
+        return;
+    }
+
+    float rightGain[rmpSmoothedParam::rampChunk], leftGain[rmpSmoothedParam::rampChunk];
+    while (numSamples > 0)
+    {
+        const int chunk = jmin(numSamples, (int)rmpSmoothedParam::rampChunk);
+        pan.fillRamp(rightGain, chunk);
+        FloatVectorOperations::fill(leftGain, 1.0f, chunk);
+        FloatVectorOperations::subtract(leftGain, rightGain, chunk);
+        FloatVectorOperations::multiply(buffer.getWritePointer(0, startSample), leftGain, chunk);
+        FloatVectorOperations::multiply(buffer.getWritePointer(1, startSample), rightGain, chunk);
+        startSample += chunk;
+        numSamples -= chunk;
+    }
 }
@@ -3,9 +3,10 @@
 #include "../JuceLibraryCode/JuceHeader.h"
 #include <map>
 #include <unordered_set>
-#include "StartStopBroadcaster.h"
+#include "VoiceLifecycle.h"
 #include "ADSR.h"
 #include "MVerb.h"
+#include "SmoothedParam.h"
 
 enum TupleValues
 {
@@ -72,6 +73,13 @@ public:
 
 
     virtual void applyOn(AudioBuffer<float> &buffer, int startSample = 0, int numSamples = -1) = 0;
+
+    /** Returns true while the effect still holds signal that would come out with silent input.
+        Stateless effects never do, so a silent input block can skip them entirely. */
+    virtual bool hasTail() { return false; };
+
+    /** Called when the host changes its sample rate, effects with rate dependent state rebuild it here. */
+    virtual void setSampleRate(double) {};
 	
 	String getName() { return name; };
 
@@ -84,6 +92,18 @@ protected:
         params.emplace(_name, valueTuple(curVal, minVal, maxVal));
     };
     virtual void syncParams() = 0;
+
+    /** Restarts the tail countdown whenever the block just written is audible. */
+    void trackTail(AudioBuffer<float> &buffer, int startSample, int numSamples, int holdSamples)
+    {
+        if (buffer.getMagnitude(startSample, numSamples) > silenceThreshold)
+            tailSamplesLeft = holdSamples;
+        else
+            tailSamplesLeft = jmax(0, tailSamplesLeft - numSamples);
+    };
+    const float silenceThreshold = 1.0e-5f; // -100 dBFS
+    int tailSamplesLeft = 0;
+
 	String name;
     Parameters params;
     std::unordered_set<Listener *> listeners;
@@ -94,8 +114,7 @@ class rmpReverb : public rmpEffect
 public:
 	rmpReverb(String _name, const double sampleRate = 48000.0f) : rmpEffect(_name)
     {
-
-		mreverb.setSampleRate(sampleRate);
+        setSampleRate(sampleRate);
 		mreverb.setParameter(MVerb<float>::DAMPINGFREQ, 0.0028);
 		mreverb.setParameter(MVerb<float>::DENSITY, 0.002);
 		mreverb.setParameter(MVerb<float>::BANDWIDTHFREQ, 0.5);
@@ -110,6 +129,13 @@ public:
 	~rmpReverb() = default;
 	
 	void applyOn(AudioBuffer<float> &buffer, int startSample = 0, int numSamples = -1) override;
+    bool hasTail() override { return tailSamplesLeft > 0; };
+    void setSampleRate(double sampleRate) override
+    {
+        // longer than the predelay and early reflections, which may hold signal while the output is quiet
+        tailHold = (int)(sampleRate / 2);
+		mreverb.setSampleRate((float)sampleRate);
+    };
 
 protected:
     void syncParams()
@@ -120,9 +146,10 @@ protected:
  
     };
 	MVerb<float> mreverb;
+    int tailHold;
 };
 
-class rmpADSR : public rmpEffect, public StartStopBroadcaster::Listener {
+class rmpADSR : public rmpEffect {
 public:
     rmpADSR(String _name, const double sampleRate = 48000.0f) : rmpEffect(_name)
     { 
@@ -130,34 +157,53 @@ public:
         addParam("decay", 0.5f, 0.0f, 1.0f);
         addParam("sustain", 0.5f, 0.0f, 1.0f);
         addParam("release", 1.0f, 0.0f, 1.0f);
+        addParam("cull", -90.0f, -120.0f, 0.0f);
+        adsr.setSampleRate(sampleRate);
     };
 	~rmpADSR() = default;
 
-    void bcStarted(StartStopBroadcaster &bc) override
+    void setSampleRate(double sampleRate) override
+    {
+        // the stage rates are derived from the sample rate when the parameters are set
+        adsr.setSampleRate(sampleRate);
+        syncParams();
+    };
+
+    /** Binds the envelope to the voice whose stages it reports. */
+    void bind(rmpVoiceLifecycle *_lifecycle) { lifecycle = _lifecycle; };
+
+    void start()
     {
         adsr.noteOn();
+        wasActive = true;
+        wasAttacking = adsr.isAttacking();
+        if (!wasAttacking && lifecycle)
+            lifecycle->post(rmpVoiceLifecycle::Event::attackFinished);
     };
-    bool bcFinishing(StartStopBroadcaster &bc) override
+    /** Returns true if a release follows, in which case the envelope posts "finished" when it ends. */
+    bool release()
     {
         if (adsr.isActive() && std::get<TupleValues::currentValue>(params["turnedOn"]) != 0)
         {
             adsr.noteOff();
-            locked = &bc;
-            return false;
-        }
-        else
             return true;
+        }
+        return false;
     };
-    void delayedFinish()
+    void kill()
     {
-        locked->reactOnDelayedStop();
-        locked = 0;
-    }
-    void setSingleParam(String param, float val)
+        adsr.reset();
+        wasActive = wasAttacking = false;
+    };
+    /** Ends a release that has dropped below the "cull" level (in dBFS, -120 disables culling).
+        The envelope goes idle, so the voice finishes after the block it is rendering. */
+    void cullIfInaudible(float blockPeak)
     {
-        rmpEffect::setSingleParam(param, val);
-        if (param == "turnedOn" && val == 0.0 && locked)
-            delayedFinish();
+        if (adsr.isReleasing() && blockPeak < cullLevel && std::get<TupleValues::currentValue>(params["turnedOn"]) != 0)
+        {
+            adsr.reset();
+            reportStage();
+        }
     };
 
 	void applyOn(AudioBuffer<float> &buffer, int startSample = 0, int numSamples = -1) override;
@@ -171,42 +217,63 @@ protected:
         rparams.sustain = getParamValue("sustain");
         rparams.release = getParamValue("release");
         adsr.setParameters(rparams);
+        cullLevel = Decibels::decibelsToGain(getParamValue("cull"), -120.0f);
     };
-    StartStopBroadcaster *locked = 0;
-    bool prevBufferStatus;
+    void reportStage()
+    {
+        if (!lifecycle)
+            return;
+        if (wasAttacking && !adsr.isAttacking())
+            lifecycle->post(rmpVoiceLifecycle::Event::attackFinished);
+        if (wasActive && !adsr.isActive())
+            lifecycle->post(rmpVoiceLifecycle::Event::finished);
+        wasAttacking = adsr.isAttacking();
+        wasActive = adsr.isActive();
+    };
+    rmpVoiceLifecycle *lifecycle = nullptr;
+    float cullLevel = 0.0f;
+    bool wasActive = false, wasAttacking = false;
     _ADSR adsr;
 };
 
 class rmpVolume : public rmpEffect {
 public:
-    rmpVolume(String _name, const double) : rmpEffect(_name)
+    rmpVolume(String _name, const double sampleRate) : rmpEffect(_name), gain(rmpSmoothedParam::Ramp::exponential, 1.0f)
     {
         addParam("value", 1.0, 0, 1);
+        gain.reset(sampleRate, 0.05);
     };
     ~rmpVolume() = default;
 
     void applyOn(AudioBuffer<float> &buffer, int startSample = 0, int numSamples = -1);
+    void setSampleRate(double sampleRate) override { gain.reset(sampleRate, 0.05); };
 
 protected:
     void syncParams()
     {
+        gain.setTargetValue(getParamValue("value"));
     };
+    rmpSmoothedParam gain;
 };
 
 class rmpPan : public rmpEffect {
 public:
-    rmpPan(String _name, const double ) : rmpEffect(_name)
+    rmpPan(String _name, const double sampleRate) : rmpEffect(_name), pan(rmpSmoothedParam::Ramp::linear, 0.0f)
     {
         addParam("value", 0, -1, 1);
+        pan.reset(sampleRate, 0.05);
     };
     ~rmpPan() = default;
 
     void applyOn(AudioBuffer<float> &buffer, int startSample, int numSamples);
+    void setSampleRate(double sampleRate) override { pan.reset(sampleRate, 0.05); };
 
 protected:
     void syncParams()
     {
+        pan.setTargetValue(getParamValue("value"));
     };
+    rmpSmoothedParam pan;
 };
 
 class rmpDelay : public rmpEffect
@@ -218,7 +285,21 @@ public:
         addParam("time", 0.5, 0, 1);
         addParam("feedback", 0.5, 0, 1);
 
-        sampleRate = _sampleRate;
+        setSampleRate(_sampleRate);
+    };
+    ~rmpDelay()
+    {
+        delete[] d_start_l;
+        delete[] d_start_r;
+    }
+
+    /** Reallocates the line for two seconds at the new rate, which empties it. */
+    void setSampleRate(double _sampleRate) override
+    {
+        delete[] d_start_l;
+        delete[] d_start_r;
+
+        sampleRate = (float)_sampleRate;
         bufferSize = 2 * sampleRate;
         d_start_l = new float[bufferSize];
         d_start_r = new float[bufferSize];
@@ -231,62 +312,73 @@ public:
             d_start_r[iter] = 0;
         }
 
-        timeParam = &std::get<TupleValues::currentValue>(params["time"]);
-        dryWetParam = &std::get<TupleValues::currentValue>(params["dryWet"]);
-        feedbackParam = &std::get<TupleValues::currentValue>(params["feedback"]);
+        dryWet.reset(sampleRate, 0.05);
+        feedback.reset(sampleRate, 0.05);
+        time.reset(sampleRate, 0.1);
 
-        write_l = d_start_l;
-        write_r = d_start_r;
-        read_l = d_start_l + ((write_l - d_start_l) + ((int)(*timeParam * sampleRate))) % bufferSize;
-        read_r = d_start_r + ((write_r - d_start_r) + ((int)(*timeParam * sampleRate))) % bufferSize;
+        read_l = d_start_l;
+        read_r = d_start_r;
+        tailSamplesLeft = 0;
     };
-    ~rmpDelay()
-    {
-        delete(d_start_l);
-        delete(d_start_r);
-    }
 
     void applyOn(AudioBuffer<float> &buffer, int startSample, int numSamples)
     {
         if (std::get<TupleValues::currentValue>(params["turnedOn"]) == 0)
+        {
+            tailSamplesLeft = 0;
             return;
+        }
         float *c_start_l = buffer.getWritePointer(0) + startSample;
         float *c_start_r = buffer.getWritePointer(1) + startSample;
-       
-        for (int iter = 0; iter < numSamples; ++iter)
+        const int totalSamples = numSamples;
+
+        float dryWetRamp[rmpSmoothedParam::rampChunk], feedbackRamp[rmpSmoothedParam::rampChunk], timeRamp[rmpSmoothedParam::rampChunk];
+        while (numSamples > 0)
         {
-            *(c_start_l) += *(read_l) * *dryWetParam * *feedbackParam;
-            *(c_start_r) += *(read_r) * *dryWetParam * *feedbackParam;
-            *(write_l) = *(c_start_l);
-            *(write_r) = *(c_start_r);
-
-
-            ++read_l; ++read_r;
-            if (read_l >= d_end_l)
-                read_l = d_start_l;
-            if (read_r >= d_end_r)
-                read_r = d_start_r;
-
-            write_l = d_start_l + ((read_l - d_start_l) + ((int)(*timeParam * sampleRate))) % bufferSize;
-            write_r = d_start_r + ((read_r - d_start_r) + ((int)(*timeParam * sampleRate))) % bufferSize;
-            float a = (write_l - read_l)/sampleRate;
-            int b = read_l - d_start_l;
-            ++c_start_l; ++c_start_r;
+            const int chunk = jmin(numSamples, (int)rmpSmoothedParam::rampChunk);
+            dryWet.fillRamp(dryWetRamp, chunk);
+            feedback.fillRamp(feedbackRamp, chunk);
+            time.fillRamp(timeRamp, chunk);
+
+            for (int iter = 0; iter < chunk; ++iter)
+            {
+                *(c_start_l) += *(read_l) * dryWetRamp[iter] * feedbackRamp[iter];
+                *(c_start_r) += *(read_r) * dryWetRamp[iter] * feedbackRamp[iter];
+
+                const int delaySamples = (int)(timeRamp[iter] * sampleRate);
+                write_l = d_start_l + ((read_l - d_start_l) + delaySamples) % bufferSize;
+                write_r = d_start_r + ((read_r - d_start_r) + delaySamples) % bufferSize;
+                *(write_l) = *(c_start_l);
+                *(write_r) = *(c_start_r);
+
+                ++read_l; ++read_r;
+                if (read_l >= d_end_l)
+                    read_l = d_start_l;
+                if (read_r >= d_end_r)
+                    read_r = d_start_r;
+                ++c_start_l; ++c_start_r;
+            }
+            numSamples -= chunk;
         }
+        // the line only ever holds what was written out, so a quiet output for its whole length means it is empty
+        trackTail(buffer, startSample, totalSamples, bufferSize);
     };
+    bool hasTail() override { return tailSamplesLeft > 0; };
 protected:
     float sampleRate;
     
-    float *d_start_l, *d_start_r;
+    float *d_start_l = nullptr, *d_start_r = nullptr;
     float *d_end_l, *d_end_r;
     int bufferSize;
-    float *timeParam, *dryWetParam, *feedbackParam;
+    rmpSmoothedParam dryWet, feedback, time;
 
     float *read_l, *read_r, *write_l, *write_r;
 
     void syncParams()
     {
-
+        dryWet.setTargetValue(getParamValue("dryWet"));
+        feedback.setTargetValue(getParamValue("feedback"));
+        time.setTargetValue(getParamValue("time"));
     };
 };
 
@@ -297,17 +389,13 @@ public:
     {
         addParam("value", 0, 0, 1);
     };
-    ~rmpFunctionalController()
-    {
-        for (auto it = linked.begin(); it != linked.end(); ++it)
-            delete(std::get<2>(*it));
-    }
+    ~rmpFunctionalController() = default;
 
     class Law
     {
     public:
         Law(float _minValue = 0, float _maxValue = 1) { minValue = _minValue; maxValue = _maxValue; };
-        ~Law() = default;
+        virtual ~Law() = default;
         virtual float applyLaw(float inp) { return inp * (maxValue - minValue) + minValue; }
     protected:
         float minValue, maxValue;
@@ -320,7 +408,7 @@ public:
         ~inverseLaw() = default;
         virtual float applyLaw(float inp) { return maxValue - inp * (maxValue - minValue); }
     };
-    typedef std::tuple <String, rmpEffect *, rmpFunctionalController::Law *> Parameter;
+    typedef std::tuple <String, rmpEffect *, std::shared_ptr<rmpFunctionalController::Law>> Parameter;
 
     void link(Parameter param)
     {
@@ -409,6 +497,18 @@ public:
         for (auto effect = rack_list.begin(); effect != rack_list.end(); ++effect)
             effect->second->applyOn(buffer, startSample, numSamples);
     };
+    bool hasTail()
+    {
+        for (auto effect = rack_list.begin(); effect != rack_list.end(); ++effect)
+            if (effect->second->hasTail())
+                return true;
+        return false;
+    };
+    void setSampleRate(double sampleRate) override
+    {
+        for (auto effect = rack_list.begin(); effect != rack_list.end(); ++effect)
+            effect->second->setSampleRate(sampleRate);
+    };
 
     rmpEffect *findEffect(String nameSubstring)
     {
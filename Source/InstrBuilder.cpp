@@ -4,24 +4,45 @@
 
 rmpSynth *InstrBuilder::parseInstr(int numberOfVoicesToCreate, CriticalSection &_lock)
 {
+    errors.clear();
     rmpSynth *synth = new rmpSynth(_lock);
-    std::shared_ptr<SummedSound> sound = std::make_shared<SummedSound>();
+    arena = std::make_shared<rmpObjectArena>();
+    synth->arena = arena;
+    std::shared_ptr<SummedSound> sound = makeInArena<SummedSound>(arena);
     synth->sound = sound;
     std::list<std::shared_ptr<SummedVoice>> &voices = synth->voices;
+    int layerIndex = 0;
     for (int i = 0; i < numberOfVoicesToCreate; ++i)
-        voices.push_back(std::make_shared<SummedVoice>(*sound));
+        voices.push_back(makeInArena<SummedVoice>(arena, *sound));
 
     forEachXmlChildElement(*instrConfig, instr_item) {
+        if (instr_item->hasTagName("bendrange"))
+            synth->pitchBendRange = instr_item->getAllSubText().getFloatValue();
+        if (instr_item->hasTagName("mpebendrange"))
+            synth->mpeBendRange = instr_item->getAllSubText().getFloatValue();
+        if (instr_item->hasTagName("vibrato"))
+        {
+            if (instr_item->getChildByName("rate"))
+                synth->vibratoRate = instr_item->getChildByName("rate")->getAllSubText().getFloatValue();
+            if (instr_item->getChildByName("depth"))
+                synth->vibratoDepth = instr_item->getChildByName("depth")->getAllSubText().getFloatValue();
+        }
         if (instr_item->hasTagName("layer"))
         {
             // Allocation
-            std::shared_ptr<LayerSound> lsound = std::make_shared<LayerSound>();
+            std::shared_ptr<LayerSound> previousLayer = findReusableLayer(instr_item, layerIndex++);
+            std::shared_ptr<LayerSound> lsound = previousLayer ? makeInArena<LayerSound>(arena, *previousLayer) : makeInArena<LayerSound>(arena);
+            // the zones are immutable and can be shared, the rack holds state of the old synth
+            lsound->rack = nullptr;
             std::list< std::shared_ptr<LayerVoice>> lvoices;
             for (int i = 0; i < voices.size(); ++i)
-                lvoices.push_back(std::make_shared<LayerVoice>(*lsound));
+                lvoices.push_back(makeInArena<LayerVoice>(arena, *lsound));
             
             // Parsing
-            parseLayer(instr_item, lsound, lvoices);
+            parseLayer(instr_item, lsound, lvoices, previousLayer != nullptr);
+            if (lsound->isCompressed())
+                for (auto lvoice = lvoices.begin(); lvoice != lvoices.end(); ++lvoice)
+                    lvoice->get()->allocateDecoders();
 
             // Attaching
             sound->layerSounds.push_back(lsound);
@@ -35,10 +56,10 @@ rmpSynth *InstrBuilder::parseInstr(int numberOfVoicesToCreate, CriticalSection &
         if (instr_item->hasTagName("effects"))
         {
             // Allocating
-            std::shared_ptr<rmpEffectRack> soundRack = std::make_shared<rmpEffectRack>();
+            std::shared_ptr<rmpEffectRack> soundRack = makeInArena<rmpEffectRack>(arena);
             std::list<std::shared_ptr<rmpEffectRack>> voiceRacks;
             for (int i = 0; i < (voices.size() * sound->layerSounds.size()); ++i)
-                voiceRacks.push_back(std::make_shared<rmpEffectRack>());
+                voiceRacks.push_back(makeInArena<rmpEffectRack>(arena));
             
             // Find all subracks
             std::vector<rmpEffectRack *> subRacks;
@@ -55,24 +76,82 @@ rmpSynth *InstrBuilder::parseInstr(int numberOfVoicesToCreate, CriticalSection &
             {
                 for (auto lvoice = (*ivoice)->layerVoices.begin(); lvoice != (*ivoice)->layerVoices.end(); ++lvoice, ++voicerack)
                     lvoice->get()->rack = *voicerack;
-                ivoice->get()->rack = std::make_shared<rmpEffectRack>();
+                ivoice->get()->rack = makeInArena<rmpEffectRack>(arena);
             }
         }
     }
     for (auto ivoice = voices.begin(); ivoice != voices.end(); ++ivoice)
     {
         for (auto lvoice = (*ivoice)->layerVoices.begin(); lvoice != (*ivoice)->layerVoices.end(); ++lvoice)
+        {
             lvoice->get()->repairRackLinks();
+            lvoice->get()->setCurrentPlaybackSampleRate(hostSampleRate);
+        }
         ivoice->get()->repairRackLinks();
     }
+    synth->sampleRate = hostSampleRate;
+    synth->indexVoices();
     return synth;
 }
 
-void InstrBuilder::parseLayer(XmlElement *layerConfig, std::shared_ptr<LayerSound> lsound, std::list<std::shared_ptr<LayerVoice>> lvoices)
+std::shared_ptr<LayerSound> InstrBuilder::findReusableLayer(XmlElement *layerConfig, int layerIndex) const
+{
+    if (!previousConfig || !previous || !previous->sound)
+        return nullptr;
+    // the previous synth holds one layer sound per layer element, in the same order
+    auto previousLayer = previous->sound->layerSounds.begin();
+    forEachXmlChildElementWithTagName(*previousConfig, previousItem, "layer")
+    {
+        if (previousLayer == previous->sound->layerSounds.end())
+            return nullptr;
+        if (layerIndex-- == 0)
+            return sameZones(layerConfig, previousItem) ? *previousLayer : nullptr;
+        ++previousLayer;
+    }
+    return nullptr;
+}
+
+bool InstrBuilder::sameZones(XmlElement *layerConfig, XmlElement *otherConfig)
+{
+    XmlElement *item = layerConfig->getFirstChildElement();
+    XmlElement *otherItem = otherConfig->getFirstChildElement();
+    for (;;)
+    {
+        while (item && item->hasTagName("effects"))
+            item = item->getNextElement();
+        while (otherItem && otherItem->hasTagName("effects"))
+            otherItem = otherItem->getNextElement();
+        if (!item || !otherItem)
+            return item == otherItem;
+        if (!item->isEquivalentTo(otherItem, false))
+            return false;
+        item = item->getNextElement();
+        otherItem = otherItem->getNextElement();
+    }
+}
+
+void InstrBuilder::parseLayer(XmlElement *layerConfig, std::shared_ptr<LayerSound> lsound, std::list<std::shared_ptr<LayerVoice>> lvoices, bool zonesReused)
 {
     forEachXmlChildElement(*layerConfig, layer_item) {
+        // a reused layer already has its settings and zones, only the rack is built again
+        if (zonesReused && !layer_item->hasTagName("effects"))
+            continue;
         if (layer_item->hasTagName("name"))
             lsound->name = layer_item->getAllSubText();
+        if (layer_item->hasTagName("velcrossfade"))
+        {
+            String curve = layer_item->getAllSubText().trim();
+            if (curve == "linear")
+                lsound->crossfade = LayerSound::Crossfade::linear;
+            else if (curve == "equalpower")
+                lsound->crossfade = LayerSound::Crossfade::equalPower;
+            else
+                lsound->crossfade = LayerSound::Crossfade::sum;
+        }
+        if (layer_item->hasTagName("trim"))
+            lsound->trimThreshold = Decibels::decibelsToGain(layer_item->getAllSubText().getFloatValue());
+        if (layer_item->hasTagName("storage"))
+            lsound->storage = layer_item->getAllSubText().trim();
         if (layer_item->hasTagName("box")) {
             soundBox tempBox;
             forEachXmlChildElement(*layer_item, params_item) {
@@ -90,24 +169,32 @@ void InstrBuilder::parseLayer(XmlElement *layerConfig, std::shared_ptr<LayerSoun
                     tempBox.highestVel = (uint8)params_item->getAllSubText().getIntValue();
                 if (params_item->hasTagName("transpose"))
                     tempBox.transposeMethod = params_item->getAllSubText();
+                if (params_item->hasTagName("pan"))
+                    tempBox.pan = params_item->getAllSubText().getFloatValue();
+                if (params_item->hasTagName("loopmode"))
+                    tempBox.loopMode = params_item->getAllSubText().trim();
+                if (params_item->hasTagName("loopstart"))
+                    tempBox.loopStart = params_item->getAllSubText().getIntValue();
+                if (params_item->hasTagName("loopend"))
+                    tempBox.loopEnd = params_item->getAllSubText().getIntValue();
+                if (params_item->hasTagName("loopxfade"))
+                    tempBox.loopCrossfade = params_item->getAllSubText().getIntValue();
                 if (params_item->hasTagName("soundfile")) {
-                    String soundfile = String(params_item->getAllSubText());
-                    MemoryInputStream *stream = (MemoryInputStream *)source->createInputStreamFor(soundfile);
-                    tempBox.soundfile_size = stream->getDataSize();
-                    tempBox.soundfile_data = malloc(tempBox.soundfile_size);
-                    memcpy(tempBox.soundfile_data, stream->getData(), tempBox.soundfile_size);
-                    delete stream;
+                    tempBox.soundfile = String(params_item->getAllSubText());
+                    tempBox.database = source->getDatabase();
                 }
             }
-            lsound->appendBox(tempBox, hostSampleRate);
+            Result appended = lsound->appendBox(tempBox, hostSampleRate);
+            if (appended.failed())
+                errors.add(lsound->name + ": " + appended.getErrorMessage());
         }
         if (layer_item->hasTagName("effects"))
         {
             // Allocating
-            std::shared_ptr<rmpEffectRack> soundRack = std::make_shared<rmpEffectRack>();
+            std::shared_ptr<rmpEffectRack> soundRack = makeInArena<rmpEffectRack>(arena);
             std::list<std::shared_ptr<rmpEffectRack>> voiceRacks;
             for (int i = 0; i < lvoices.size(); ++i)
-                voiceRacks.push_back(std::make_shared<rmpEffectRack>());
+                voiceRacks.push_back(makeInArena<rmpEffectRack>(arena));
 
             // Parsing
             parseRack(layer_item, soundRack, voiceRacks);
@@ -125,21 +212,21 @@ void InstrBuilder::parseRack(XmlElement *rackConfig, std::shared_ptr<rmpEffectRa
         if (effect_item->hasTagName("volume"))
         {
             String _name = "volume" + String(soundRack->getRackSize() + 1);
-            std::shared_ptr<rmpVolume> eff = std::make_shared<rmpVolume>(_name, hostSampleRate);
+            std::shared_ptr<rmpVolume> eff = makeInArena<rmpVolume>(arena, _name, hostSampleRate);
             eff->setSingleParam("value", effect_item->getChildByName("value")->getAllSubText().getFloatValue());
             soundRack->addEffect(_name, eff);
         }
         if (effect_item->hasTagName("pan"))
         {
             String _name = "pan" + String(soundRack->getRackSize() + 1);
-            std::shared_ptr<rmpPan> eff = std::make_shared<rmpPan>(_name, hostSampleRate);
+            std::shared_ptr<rmpPan> eff = makeInArena<rmpPan>(arena, _name, hostSampleRate);
             eff->setSingleParam("value", effect_item->getChildByName("value")->getAllSubText().getFloatValue());
             soundRack->addEffect(_name, eff);
         }
         if (effect_item->hasTagName("reverb"))
         {
             String _name = "reverb" + String(soundRack->getRackSize() + 1);
-            std::shared_ptr<rmpReverb> eff = std::make_shared<rmpReverb>(_name, hostSampleRate);
+            std::shared_ptr<rmpReverb> eff = makeInArena<rmpReverb>(arena, _name, hostSampleRate);
             eff->setSingleParam("dryWet", effect_item->getChildByName("dryWet")->getAllSubText().getFloatValue());
             eff->setSingleParam("roomSize", effect_item->getChildByName("roomSize")->getAllSubText().getFloatValue());
             eff->setSingleParam("width", effect_item->getChildByName("width")->getAllSubText().getFloatValue());
@@ -148,7 +235,7 @@ void InstrBuilder::parseRack(XmlElement *rackConfig, std::shared_ptr<rmpEffectRa
         if (effect_item->hasTagName("delay"))
         {
             String _name = "delay" + String(soundRack->getRackSize() + 1);
-            std::shared_ptr<rmpDelay> eff = std::make_shared<rmpDelay>(_name, hostSampleRate);
+            std::shared_ptr<rmpDelay> eff = makeInArena<rmpDelay>(arena, _name, hostSampleRate);
             eff->setSingleParam("dryWet", effect_item->getChildByName("dryWet")->getAllSubText().getFloatValue());
             eff->setSingleParam("time", effect_item->getChildByName("time")->getAllSubText().getFloatValue());
             eff->setSingleParam("feedback", effect_item->getChildByName("feedback")->getAllSubText().getFloatValue());
@@ -160,8 +247,8 @@ void InstrBuilder::parseRack(XmlElement *rackConfig, std::shared_ptr<rmpEffectRa
 
             std::list<std::shared_ptr<rmpADSR>> voiceeff;
             for (int i = 0; i < voiceRacks.size(); ++i)
-                voiceeff.push_back(std::make_shared<rmpADSR>(_name, hostSampleRate));
-            std::shared_ptr<rmpMirrorController> contr = std::make_shared<rmpMirrorController>(_name, **voiceeff.begin(), hostSampleRate);
+                voiceeff.push_back(makeInArena<rmpADSR>(arena, _name, hostSampleRate));
+            std::shared_ptr<rmpMirrorController> contr = makeInArena<rmpMirrorController>(arena, _name, **voiceeff.begin(), hostSampleRate);
             for (auto it = voiceeff.begin(); it != voiceeff.end(); ++it)
                 contr->linkRack(*it);
 
@@ -169,6 +256,8 @@ void InstrBuilder::parseRack(XmlElement *rackConfig, std::shared_ptr<rmpEffectRa
             contr->setSingleParam("decay", effect_item->getChildByName("decay")->getAllSubText().getFloatValue());
             contr->setSingleParam("sustain", effect_item->getChildByName("sustain")->getAllSubText().getFloatValue());
             contr->setSingleParam("release", effect_item->getChildByName("release")->getAllSubText().getFloatValue());
+            if (effect_item->getChildByName("cull"))
+                contr->setSingleParam("cull", effect_item->getChildByName("cull")->getAllSubText().getFloatValue());
             contr->setSingleParam("broken", 0);
 
             soundRack->addEffect(_name, contr);
@@ -182,13 +271,13 @@ void InstrBuilder::parseRack(XmlElement *rackConfig, std::shared_ptr<rmpEffectRa
         {
             String _name = "func" + String(soundRack->getRackSize() + 1);
 
-            std::shared_ptr<rmpFunctionalController> contr = std::make_shared<rmpFunctionalController>(_name, hostSampleRate);
+            std::shared_ptr<rmpFunctionalController> contr = makeInArena<rmpFunctionalController>(arena, _name, hostSampleRate);
             forEachXmlChildElementWithTagName(*effect_item, link_item, "link")
             {
                 rmpEffectRack * subRack = 0;
                 rmpEffect *effect = 0;
                 String name = "";
-                rmpFunctionalController::Law *law = 0;
+                std::shared_ptr<rmpFunctionalController::Law> law;
                 forEachXmlChildElement(*link_item, param_item)
                 {
                     if (param_item->hasTagName("layer"))
@@ -214,9 +303,9 @@ void InstrBuilder::parseRack(XmlElement *rackConfig, std::shared_ptr<rmpEffectRa
                     {
                         String lawName = param_item->getAllSubText();;
                         if (lawName == "default")
-                            law = new rmpFunctionalController::Law();
+                            law = makeInArena<rmpFunctionalController::Law>(arena);
                         if (lawName == "inverse")
-                            law = new rmpFunctionalController::inverseLaw();
+                            law = makeInArena<rmpFunctionalController::inverseLaw>(arena);
                     }
                 }
                 contr->link(rmpFunctionalController::Parameter(name, effect, law));
@@ -5,6 +5,7 @@
 #include "rmpSynth.h"
 #include "EffectRack.h"
 #include "SQLInputSource.h"
+#include "ObjectArena.h"
 #include <vector>
 
 class InstrBuilder
@@ -18,12 +19,33 @@ public:
     }
     ~InstrBuilder() = default;
 
+    /** Lets parseInstr copy the zones of every layer whose boxes are unchanged from
+        _previousConfig, the configuration _previous was built from, instead of parsing them
+        again. Both must come from the same pack and outlive parseInstr. */
+    void reuseFrom(XmlElement *_previousConfig, rmpSynth *_previous)
+    {
+        previousConfig = _previousConfig;
+        previous = _previous;
+    }
+
     rmpSynth *parseInstr(int numberOfVoicesToCreate, CriticalSection &_lock);
+    /** What made the last parseInstr build an instrument that must not be played, empty if
+        it succeeded. */
+    const StringArray &getErrors() const { return errors; }
 protected:
-    void parseLayer(XmlElement *layerConfig, std::shared_ptr<LayerSound> lsound, std::list<std::shared_ptr<LayerVoice>> lvoices);
+    /** The layer of the previous synth built from the same boxes, nullptr if there is none. */
+    std::shared_ptr<LayerSound> findReusableLayer(XmlElement *layerConfig, int layerIndex) const;
+    /** True if both layers differ at most in their effects. */
+    static bool sameZones(XmlElement *layerConfig, XmlElement *otherConfig);
+    void parseLayer(XmlElement *layerConfig, std::shared_ptr<LayerSound> lsound, std::list<std::shared_ptr<LayerVoice>> lvoices, bool zonesReused = false);
     void parseRack(XmlElement *rackConfig, std::shared_ptr<rmpEffectRack> soundRack, std::list<std::shared_ptr<rmpEffectRack>> voiceRacks, std::vector<rmpEffectRack *> subRacks = std::vector<rmpEffectRack *>());
 private:
     XmlElement *instrConfig;
     SQLInputSource *source;
     float hostSampleRate;
+    XmlElement *previousConfig = nullptr;
+    rmpSynth *previous = nullptr;
+    StringArray errors;
+    // where every object of the instrument being built is allocated
+    std::shared_ptr<rmpObjectArena> arena;
 };
\ No newline at end of file
@@ -112,20 +112,14 @@ void rmpLibraryMenu::sliderValueChanged(Slider *slider) {
 
 void rmpInstrumentMenuItem::itemClicked(const MouseEvent &) {
     rmpLibraryMenu *menu = static_cast<rmpLibraryMenu *>(this->getOwnerView());
-    if (menu->selectedItemName == name)
-    {
-
-    }
-    else 
-    {
-        menu->selectedItemName = name;
-        SQLInputSource *dbsource = new SQLInputSource(instr_path, db_path);
-        MemoryInputStream *stream = (MemoryInputStream *)dbsource->createInputStream();
-        char *data = (char *)stream->getData();
-        XmlElement *ex = new XmlElement(*parseXML(String(CharPointer_UTF8(data))));
-        static_cast<rmpLibraryMenu *>(this->getOwnerView())->listener->instrumentSelected(name, ex, dbsource);
-        delete stream;
-    }
+    // clicking the selected instrument again reloads it, the processor only rebuilds what changed
+    menu->selectedItemName = name;
+    SQLInputSource *dbsource = new SQLInputSource(instr_path, db_path);
+    MemoryInputStream *stream = (MemoryInputStream *)dbsource->createInputStream();
+    char *data = (char *)stream->getData();
+    XmlElement *ex = new XmlElement(*parseXML(String(CharPointer_UTF8(data))));
+    static_cast<rmpLibraryMenu *>(this->getOwnerView())->listener->instrumentSelected(name, ex, dbsource);
+    delete stream;
 
 };
 
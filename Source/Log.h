@@ -0,0 +1,34 @@
+/*
+  ==============================================================================
+
+    Log.h
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include <memory>
+
+/** The log file of the plugin, Hyperia.log in the user's log folder.
+
+    Load and memory reports go here instead of to DBG, so release builds on a render node keep
+    them. One instance is shared by every processor through a SharedResourcePointer, and
+    FileLogger serialises writes from any thread.
+*/
+class rmpLog
+{
+public:
+    rmpLog() : logger(FileLogger::createDefaultAppLogger("Hyperia", "Hyperia.log", "Hyperia log")) {}
+    ~rmpLog() = default;
+
+    void write(const String &message)
+    {
+        if (logger)
+            logger->logMessage(message);
+    }
+
+private:
+    std::unique_ptr<FileLogger> logger;
+};
@@ -0,0 +1,106 @@
+/*
+  ==============================================================================
+
+    ObjectArena.h
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include <memory>
+#include <utility>
+#include <vector>
+
+/** Memory for the objects of one instrument, handed out in the order they are built.
+
+    Voices, racks, effects and controllers built together land next to each other, their
+    shared_ptr control blocks included, instead of all over the heap. Nothing is freed one
+    by one: every object made with makeInArena() keeps the arena alive, and the arena
+    returns all of its blocks at once when the last of them is destroyed.
+
+    Only the thread building the instrument allocates from it.
+*/
+class rmpObjectArena
+{
+public:
+    rmpObjectArena() = default;
+    ~rmpObjectArena() = default;
+
+    void *allocate(size_t bytes, size_t alignment)
+    {
+        usedBytes += bytes;
+        // an object larger than a block gets one of its own, the current block carries on
+        if (bytes + alignment > blockBytes)
+            return align(addBlock(bytes + alignment), alignment);
+        uint8 *start = align(next, alignment);
+        if (next == nullptr || start + bytes > end)
+        {
+            next = addBlock(blockBytes);
+            end = next + blockBytes;
+            start = align(next, alignment);
+        }
+        next = start + bytes;
+        return start;
+    }
+
+    size_t getUsedBytes() const noexcept { return usedBytes; }
+    size_t getReservedBytes() const noexcept { return reservedBytes; }
+    int getNumBlocks() const noexcept { return (int)blocks.size(); }
+
+    static const size_t blockBytes = 64 << 10;
+
+private:
+    uint8 *addBlock(size_t size)
+    {
+        blocks.emplace_back();
+        blocks.back().malloc(size);
+        reservedBytes += size;
+        return blocks.back().getData();
+    }
+
+    static uint8 *align(uint8 *pointer, size_t alignment) noexcept
+    {
+        return reinterpret_cast<uint8 *>((reinterpret_cast<uintptr_t>(pointer) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    }
+
+    std::vector<HeapBlock<uint8>> blocks;
+    uint8 *next = nullptr, *end = nullptr;
+    size_t usedBytes = 0, reservedBytes = 0;
+
+    JUCE_DECLARE_NON_COPYABLE(rmpObjectArena)
+};
+
+/** Allocator drawing from an rmpObjectArena, freeing is left to the arena. */
+template <class T>
+class rmpArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit rmpArenaAllocator(std::shared_ptr<rmpObjectArena> _arena) noexcept : arena(std::move(_arena)) {}
+    template <class U>
+    rmpArenaAllocator(const rmpArenaAllocator<U> &other) noexcept : arena(other.arena) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T *, size_t) noexcept {}
+
+    template <class U>
+    bool operator==(const rmpArenaAllocator<U> &other) const noexcept { return arena == other.arena; }
+    template <class U>
+    bool operator!=(const rmpArenaAllocator<U> &other) const noexcept { return arena != other.arena; }
+
+private:
+    template <class U>
+    friend class rmpArenaAllocator;
+    // the control block of every object holds a copy, so the arena outlives them all
+    std::shared_ptr<rmpObjectArena> arena;
+};
+
+/** make_shared for an object of the instrument, built in its arena. */
+template <class T, class... Args>
+std::shared_ptr<T> makeInArena(const std::shared_ptr<rmpObjectArena> &arena, Args &&... args)
+{
+    return std::allocate_shared<T>(rmpArenaAllocator<T>(arena), std::forward<Args>(args)...);
+}
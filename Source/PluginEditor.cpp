@@ -182,7 +182,9 @@ rmpAudioProcessorEditor::~rmpAudioProcessorEditor()
 void rmpAudioProcessorEditor::instrumentSelected(String configName, XmlElement *config, SQLInputSource *source)
 {
     processor->applyInstrumentConfig(configName, config, source);
-    attachElements();
+    // a rejected instrument leaves an empty program empty
+    if (processor->getSynth())
+        attachElements();
 }
 
 void rmpAudioProcessorEditor::attachElements()
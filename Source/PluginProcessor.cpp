@@ -5,6 +5,9 @@
 rmpAudioProcessor::rmpAudioProcessor() : AudioProcessor (BusesProperties().withOutput ("Output", AudioChannelSet::stereo(), true))
 {
     numSamples = 0;
+    const String fadeMilliseconds = SystemStats::getEnvironmentVariable("HYPERIA_SWAP_FADE_MS", "");
+    if (fadeMilliseconds.isNotEmpty())
+        setSwapCrossfade(fadeMilliseconds.getDoubleValue() / 1000.0);
 	
 	File datafile = File::getSpecialLocation(File::userHomeDirectory).getChildFile("hyperia.data");
 	if (!datafile.getSize()) {
@@ -16,47 +19,120 @@ rmpAudioProcessor::rmpAudioProcessor() : AudioProcessor (BusesProperties().withO
 	}
 	else
 		libraryPath = datafile.loadFileAsString();
-
-    synth = nullptr;
 }
 
 void rmpAudioProcessor::applyInstrumentConfig(String configName, XmlElement *config, SQLInputSource *source) 
 {
-    if (currentConfigName == configName)
+    loadProgram(currentProgram.load(), configName, config, source);
+}
+
+void rmpAudioProcessor::loadProgram(int index, String configName, XmlElement *config, SQLInputSource *source)
+{
+    jassert(isPositiveAndBelow(index, numPrograms));
+    Program &program = programs[index];
+    if (program.configName == configName && program.config && config->isEquivalentTo(program.config, false))
+    {
+        delete(config);
+        delete(source);
         return;
+    }
 
-	currentConfigName = configName;
-    if (currentConfig)
-        delete(currentConfig);
-    if (currentSource)
-        delete(currentSource);
-    currentConfig = config;
-    currentSource = source;
-    reloadSynth();
+    // kept until the new synth is built, an edit of the same instrument only rebuilds what changed
+    const String previousName = program.configName;
+    XmlElement *previousConfig = program.config;
+    SQLInputSource *previousSource = program.source;
+    const bool samePack = program.configName == configName && previousSource
+        && previousSource->getDatabase() == source->getDatabase();
+    program.configName = configName;
+    program.config = config;
+    program.source = source;
+    if (!reloadSynth(index, samePack ? previousConfig : nullptr))
+    {
+        // the program keeps playing what it had
+        program.configName = previousName;
+        program.config = previousConfig;
+        program.source = previousSource;
+        delete(config);
+        delete(source);
+        return;
+    }
+    if (previousConfig)
+        delete(previousConfig);
+    if (previousSource)
+        delete(previousSource);
 }
 
-void rmpAudioProcessor::reloadSynth()
+bool rmpAudioProcessor::reloadSynth(int index, XmlElement *previousConfig)
 {
-    if (currentConfigName == "")
-        return;
+    Program &program = programs[index];
+    if (program.configName == "")
+        return true;
         
-    if (synth)
+    InstrBuilder builder(program.config, program.source, sampleRate);
+    if (previousConfig)
+        builder.reuseFrom(previousConfig, program.synth.load());
+    rmpSynth *built = builder.parseInstr(4, lock);
+    if (!builder.getErrors().isEmpty())
     {
-        synth->turnOff();
-        if (prevSynth)
-            delete(prevSynth);
-        prevSynth = synth;
+        AlertWindow::showMessageBoxAsync(AlertWindow::WarningIcon, "Hyperia",
+            program.configName + " was not loaded:\n" + builder.getErrors().joinIntoString("\n"));
+        // never published, but as large as any synth
+        reclaimer->retire(built, renderEpoch);
+        return false;
     }
-    InstrBuilder builder(currentConfig, currentSource, sampleRate);
-    synth = builder.parseInstr(4, lock);
+    // only the message thread replaces programs, so this is the synth the exchange returns
+    rmpSynth *previous = program.synth.load();
+    const bool fade = previous && index == currentProgram.load() && swapFadeSeconds.load() > 0.0;
+    if (fade)
+    {
+        // its held notes and tails fade out next to the new synth, replacing the one still
+        // fading from an earlier swap cuts that fade short; set up before the swap, so no
+        // block renders the new synth while the old one still takes notes or is cut off
+        previous->setAcceptingNotes(false);
+        fadingSynth->store(previous);
+    }
+    rmpSynth *retired = program.synth.exchange(built);
+    jassert(retired == previous);
+    log->write(built->describeStorage());
+    if (retired)
+    {
+        // the decoding cost of compressed layers is only known after playing them
+        log->write(retired->describeStorage());
+        if (!fade)
+            retired->turnOff();
+        // freed on the reclaimer thread once any fade is over and the audio thread is done with it
+        reclaimer->retire(retired, renderEpoch, fadingSynth);
+    }
+    // the other programs are counted again too, the manager adds and evicts levels of their
+    // recordings meanwhile; only this thread replaces programs, so their synths stay valid
+    for (int other = 0; other < numPrograms; ++other)
+        if (rmpSynth *resident = programs[other].synth.load())
+            programs[other].residentBytes.store((int64)resident->getResidentBytes());
+    updateHostDisplay();
+    log->write(describePrograms());
+    return true;
+}
+
+String rmpAudioProcessor::describePrograms() const
+{
+    String report;
+    for (int index = 0; index < numPrograms; ++index)
+        if (programs[index].configName.isNotEmpty())
+            report << "program " << String(index) << ": " << programs[index].configName << ", "
+                << String((double)getProgramBytes(index) / 1048576.0, 1) << " MB\n";
+    report << "recordings shared by several programs are counted in each of them";
+    return report;
 }
 
 void rmpAudioProcessor::prepareToPlay (double newRate, int samplesPerBlock)
 {
     numSamples = samplesPerBlock;
     sampleRate = newRate;
-    if (synth)
-        reloadSynth();
+    fadeBuffer.setSize(jmax(1, getTotalNumOutputChannels()), samplesPerBlock);
+    // recordings keep their native rate, so only the playback rates and effects follow the host
+    for (int index = 0; index < numPrograms; ++index)
+        if (rmpSynth *resident = programs[index].synth.load())
+            resident->setCurrentPlaybackSampleRate(newRate);
 }
 
 void rmpAudioProcessor::processBlock (AudioBuffer<float>& buffer, MidiBuffer& midiMessages)
@@ -69,12 +145,130 @@ void rmpAudioProcessor::processBlock (AudioBuffer<float>& buffer, MidiBuffer& mi
         buffer.clear (i, 0, buffer.getNumSamples());
 
     keyboardState.processNextMidiBuffer (midiMessages, 0, numSamples, true);
-    if (synth)
-        synth->renderNextBlock(buffer, midiMessages, 0, numSamples);
+    renderEpoch->fetch_add(1);
+    // a program change takes effect at its own sample, the notes before it still play on the
+    // program they were sent to
+    MidiBuffer::Iterator midiIterator(midiMessages);
+    MidiMessage m;
+    int midiEventPos;
+    int rangeStart = 0;
+    while (midiIterator.getNextEvent(m, midiEventPos))
+    {
+        if (!m.isProgramChange())
+            continue;
+        const int changeAt = jlimit(rangeStart, numSamples, midiEventPos);
+        renderRange(buffer, midiMessages, rangeStart, changeAt - rangeStart);
+        applyProgramChange(m);
+        rangeStart = changeAt;
+    }
+    renderRange(buffer, midiMessages, rangeStart, numSamples - rangeStart);
+    renderEpoch->fetch_add(1);
 
     midiMessages.clear();
 }
 
+void rmpAudioProcessor::applyProgramChange(const MidiMessage& message) noexcept
+{
+    const int index = message.getProgramChangeNumber();
+    if (index < numPrograms && programs[index].synth.load())
+        currentProgram.store(index);
+}
+
+void rmpAudioProcessor::renderRange(AudioBuffer<float>& buffer, const MidiBuffer& midiMessages, int startSample, int numSamplesInRange)
+{
+    rmpSynth *current = programs[currentProgram.load()].synth.load();
+    followProgramChange(current);
+    if (numSamplesInRange <= 0)
+        return;
+    if (current)
+        current->renderNextBlock(buffer, midiMessages, startSample, numSamplesInRange);
+    renderFades(buffer, midiMessages, startSample, numSamplesInRange);
+}
+
+bool rmpAudioProcessor::isResident(const rmpSynth *candidate) const noexcept
+{
+    for (int index = 0; index < numPrograms; ++index)
+        if (programs[index].synth.load() == candidate)
+            return true;
+    return false;
+}
+
+void rmpAudioProcessor::followProgramChange(rmpSynth *current)
+{
+    // replaced while fading out, it belongs to the reclaimer now and must not be touched
+    if (programFadeSource && !isResident(programFadeSource))
+        programFadeSource = nullptr;
+    if (current == renderedSynth)
+        return;
+
+    // coming back to a program still fading out picks up its held notes
+    if (current == programFadeSource)
+        programFadeSource = nullptr;
+    // a synth no longer resident was replaced by a reload, which fades it out on its own
+    if (renderedSynth && isResident(renderedSynth))
+    {
+        renderedSynth->setAcceptingNotes(false);
+        if (programFadeSource)
+            programFadeSource->reset();
+        programFadeSource = nullptr;
+        if (swapFadeSeconds.load() > 0.0)
+        {
+            programFadeSource = renderedSynth;
+            programFadeGain.reset(sampleRate, swapFadeSeconds.load());
+            programFadeGain.setCurrentAndTargetValue(1.0f);
+            programFadeGain.setTargetValue(0.0f);
+        }
+        else
+            renderedSynth->reset();
+    }
+    if (current)
+        current->setAcceptingNotes(true);
+    renderedSynth = current;
+}
+
+bool rmpAudioProcessor::mixFading(rmpSynth *fading, rmpSmoothedParam &gain, AudioBuffer<float>& buffer, const MidiBuffer& midiMessages, int startSample, int numSamplesInRange)
+{
+    const int fadeSamples = jmin(numSamplesInRange, jmin(buffer.getNumSamples(), fadeBuffer.getNumSamples()) - startSample);
+    if (fadeSamples <= 0)
+        return false;
+    fadeBuffer.clear(startSample, fadeSamples);
+    // the note-offs still reach the held notes, the note-ons only go to the new synth
+    fading->renderNextBlock(fadeBuffer, midiMessages, startSample, fadeSamples);
+    gain.applyGain(fadeBuffer, startSample, fadeSamples);
+    for (int channel = 0; channel < jmin(buffer.getNumChannels(), fadeBuffer.getNumChannels()); ++channel)
+        buffer.addFrom(channel, startSample, fadeBuffer, channel, startSample, fadeSamples);
+    return !gain.isSmoothing() || !fading->isSounding();
+}
+
+void rmpAudioProcessor::renderFades(AudioBuffer<float>& buffer, const MidiBuffer& midiMessages, int startSample, int numSamplesInRange)
+{
+    rmpSynth *fading = fadingSynth->load();
+    // handed over just before its program swaps, it still plays as the current synth
+    if (fading == renderedSynth)
+        fading = nullptr;
+    if (fading != fadeSource)
+    {
+        // a new swap, possibly cutting short the fade of the one before
+        fadeSource = fading;
+        fadeGain.reset(sampleRate, swapFadeSeconds.load());
+        fadeGain.setCurrentAndTargetValue(1.0f);
+        fadeGain.setTargetValue(0.0f);
+    }
+    if (fading && mixFading(fading, fadeGain, buffer, midiMessages, startSample, numSamplesInRange))
+    {
+        // not touched again, the reclaimer frees it once this callback has returned
+        fadingSynth->compare_exchange_strong(fading, nullptr);
+        fadeSource = nullptr;
+    }
+
+    // a program faded out stays resident, without the notes it was holding
+    if (programFadeSource && mixFading(programFadeSource, programFadeGain, buffer, midiMessages, startSample, numSamplesInRange))
+    {
+        programFadeSource->reset();
+        programFadeSource = nullptr;
+    }
+}
+
 AudioProcessor* JUCE_CALLTYPE createPluginFilter()
 {
     return new rmpAudioProcessor();
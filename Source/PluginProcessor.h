@@ -5,6 +5,9 @@
 #include "SQLInputSource.h"
 #include "PluginEditor.h"
 #include "InstrBuilder.h"
+#include "SynthReclaimer.h"
+#include "Log.h"
+#include <atomic>
 
 class rmpAudioProcessor  : public AudioProcessor
 {
@@ -12,19 +15,27 @@ public:
     rmpAudioProcessor();
     ~rmpAudioProcessor() 
     { 
-        if (synth) 
-            delete(synth); 
-        if (prevSynth) 
-            delete(prevSynth); 
-        if (currentConfig)
-            delete(currentConfig);
-        if (currentSource)
-            delete(currentSource);
+        // lets go of a synth still fading out, it is already queued on the reclaimer
+        fadingSynth->store(nullptr);
+        for (int index = 0; index < numPrograms; ++index)
+        {
+            reclaimer->retire(programs[index].synth.exchange(nullptr), renderEpoch);
+            if (programs[index].config)
+                delete(programs[index].config);
+            if (programs[index].source)
+                delete(programs[index].source);
+        }
     };
     
     void prepareToPlay (double sampleRate, int samplesPerBlock) override;
+    /** Loads an instrument into the current program. */
     void applyInstrumentConfig(String configName, XmlElement *config, SQLInputSource *source);
-    void reloadSynth();
+    /** Loads an instrument into a program, where it stays resident until it is replaced. */
+    void loadProgram(int index, String configName, XmlElement *config, SQLInputSource *source);
+    /** Builds the configuration of a program and swaps it in. The layers whose boxes are the
+        same in previousConfig, the configuration of the running synth, keep their zones.
+        Returns false, and keeps the running synth, if the instrument was rejected. */
+    bool reloadSynth(int index, XmlElement *previousConfig = nullptr);
     void releaseResources() override {};
 
     bool isBusesLayoutSupported (const BusesLayout& layouts) const override
@@ -44,27 +55,83 @@ public:
     bool isMidiEffect() const override { return false; };
     double getTailLengthSeconds() const override { return 0.0; };
 
-    int getNumPrograms() override { return 1; };
-    int getCurrentProgram() override { return 0; };
-    void setCurrentProgram(int) override { return; };
-    const String getProgramName(int) override { return "Hyperia"; };
+    int getNumPrograms() override { return numPrograms; };
+    int getCurrentProgram() override { return currentProgram.load(); };
+    // the host may pick an empty program to load an instrument into it
+    void setCurrentProgram(int index) override { if (isPositiveAndBelow(index, numPrograms)) currentProgram.store(index); };
+    // the host lists the memory of every loaded program next to its name
+    const String getProgramName(int index) override
+    {
+        if (!isPositiveAndBelow(index, numPrograms) || programs[index].configName.isEmpty())
+            return "Hyperia";
+        return programs[index].configName + " (" + String((double)getProgramBytes(index) / 1048576.0, 1) + " MB)";
+    };
     void changeProgramName(int, const String&) override { return; };
 
     void getStateInformation(MemoryBlock&) override {};
     void setStateInformation(const void*, int) override {};
 
     MidiKeyboardState& getKBState() { return keyboardState; };
-    rmpSynth* getSynth() { return synth; };
-    void reset() { if (synth) synth->reset(); };
+    rmpSynth* getSynth() { return programs[currentProgram.load()].synth.load(); };
+    void reset() { if (rmpSynth *current = getSynth()) current->reset(); };
+    /** Bytes held by the synth of a program as of its last load, 0 for an empty one. Safe
+        from any thread. */
+    int64 getProgramBytes(int index) const { return isPositiveAndBelow(index, numPrograms) ? programs[index].residentBytes.load() : 0; };
+    /** One line per loaded program with the memory its synth holds. */
+    String describePrograms() const;
+    /** How long the notes of a replaced instrument keep fading out next to the new one,
+        0 cuts them off at the swap. */
+    void setSwapCrossfade(double seconds) { swapFadeSeconds.store(jmax(0.0, seconds)); };
+    double getSwapCrossfade() const { return swapFadeSeconds.load(); };
 
 	String libraryPath;
 
-    String currentConfigName = "";
-    XmlElement *currentConfig = nullptr; 
-    SQLInputSource *currentSource = nullptr;
+    static const int numPrograms = 8;
 private:
+    /** An instrument kept built, so that a program change only has to point at it. */
+    struct Program
+    {
+        String configName;
+        XmlElement *config = nullptr;
+        SQLInputSource *source = nullptr;
+        std::atomic<rmpSynth *> synth { nullptr };
+        // counted on the message thread, so the host can read it while programs change
+        std::atomic<int64> residentBytes { 0 };
+    };
+
     CriticalSection lock;
-    rmpSynth *synth = nullptr, *prevSynth = nullptr;
+    Program programs[numPrograms];
+    std::atomic<int> currentProgram { 0 };
+    // odd while processBlock runs, tells the reclaimer when a replaced synth is out of use
+    std::shared_ptr<std::atomic<uint32>> renderEpoch = std::make_shared<std::atomic<uint32>>(0);
+    SharedResourcePointer<rmpSynthReclaimer> reclaimer;
+    // storage reports of every load
+    SharedResourcePointer<rmpLog> log;
+
+    /** Follows a program change from the MIDI of the block. Only loaded programs are
+        selected, so a wrong message never silences a live rig. */
+    void applyProgramChange(const MidiMessage& message) noexcept;
+    /** Renders a range of the block with the current program and the synths fading out. */
+    void renderRange(AudioBuffer<float>& buffer, const MidiBuffer& midiMessages, int startSample, int numSamplesInRange);
+    /** True if the synth is loaded in a program, read from the audio thread. */
+    bool isResident(const rmpSynth *candidate) const noexcept;
+    /** Starts fading out the synth rendered until now when another one takes over. */
+    void followProgramChange(rmpSynth *current);
+    /** Mixes a fading synth into the block with a falling gain, returns true once the ramp
+        is over or nothing is sounding anymore. */
+    bool mixFading(rmpSynth *fading, rmpSmoothedParam &gain, AudioBuffer<float>& buffer, const MidiBuffer& midiMessages, int startSample, int numSamplesInRange);
+    void renderFades(AudioBuffer<float>& buffer, const MidiBuffer& midiMessages, int startSample, int numSamplesInRange);
+    // the replaced synth while it fades out, the audio thread clears it when the fade is over
+    std::shared_ptr<std::atomic<rmpSynth *>> fadingSynth = std::make_shared<std::atomic<rmpSynth *>>(nullptr);
+    std::atomic<double> swapFadeSeconds { 0.15 };
+    // audio thread only
+    rmpSynth *fadeSource = nullptr;
+    rmpSmoothedParam fadeGain;
+    AudioBuffer<float> fadeBuffer;
+    // the synth of the last block, and the resident one fading out after a program change
+    rmpSynth *renderedSynth = nullptr;
+    rmpSynth *programFadeSource = nullptr;
+    rmpSmoothedParam programFadeGain;
 
     float sampleRate = 0;
     int numSamples = 0;
@@ -22,6 +22,8 @@ public:
     InputStream* createInputStream() override;
     InputStream* createInputStreamFor (const String& relatedItemPath) override;
     int64 hashCode() const override;
+    /** Path of the pack database the files are read from. */
+    String getDatabase() const { return dbname; }
 
 private:
     String dbname;
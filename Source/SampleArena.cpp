@@ -0,0 +1,347 @@
+/*
+  ==============================================================================
+
+    SampleArena.cpp
+
+  ==============================================================================
+*/
+
+#include "SampleArena.h"
+#include <map>
+
+#if JUCE_WINDOWS
+ #include <windows.h>
+#else
+ #include <sys/mman.h>
+ #include <unistd.h>
+#endif
+
+class rmpSampleArena::Chunk
+{
+public:
+    Chunk(size_t _size, bool _shared, HugePages hugePages, bool lockPages, std::shared_ptr<Statistics> _statistics)
+        : size(_size), shared(_shared), statistics(std::move(_statistics))
+    {
+        bool huge = false;
+#if JUCE_WINDOWS
+        if (hugePages != HugePages::off && GetLargePageMinimum() > 0 && size % GetLargePageMinimum() == 0)
+        {
+            // only granted with SeLockMemoryPrivilege, large pages are locked by nature
+            data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            huge = data != nullptr;
+        }
+        if (!data)
+            data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+ #ifdef MAP_HUGETLB
+        if (hugePages == HugePages::explicitPool)
+        {
+            data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            huge = data != MAP_FAILED;
+            if (!huge)
+                data = nullptr;
+        }
+ #endif
+        if (!data)
+        {
+            data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+            if (data == MAP_FAILED)
+                data = nullptr;
+ #ifdef MADV_HUGEPAGE
+            // advised before the pages are touched, so the kernel backs them with huge pages right away
+            else if (hugePages != HugePages::off)
+                huge = madvise(data, size, MADV_HUGEPAGE) == 0;
+ #endif
+        }
+#endif
+        if (!data)
+            return;
+
+        // prefault every page now rather than on the first note that reads it
+        const size_t pageBytes = 4096;
+        volatile uint8 *pages = static_cast<volatile uint8 *>(data);
+        for (size_t offset = 0; offset < size; offset += pageBytes)
+            pages[offset] = 0;
+
+        if (lockPages)
+        {
+#if JUCE_WINDOWS
+            // large pages are never paged out in the first place
+            locked = huge || VirtualLock(data, size) != 0;
+#else
+            locked = mlock(data, size) == 0;
+#endif
+            if (!locked)
+                ++statistics->lockFailures;
+        }
+
+        statistics->mappedBytes += (int64)size;
+        statistics->chunks += 1;
+        if (huge)
+            statistics->hugePageBytes += (int64)size;
+        hugePageBacked = huge;
+        if (locked)
+            statistics->lockedBytes += (int64)size;
+        freeRanges.emplace(0, size);
+    }
+
+    ~Chunk()
+    {
+        if (!data)
+            return;
+        statistics->mappedBytes -= (int64)size;
+        statistics->chunks -= 1;
+        if (hugePageBacked)
+            statistics->hugePageBytes -= (int64)size;
+        if (locked)
+            statistics->lockedBytes -= (int64)size;
+#if JUCE_WINDOWS
+        if (locked && !hugePageBacked)
+            VirtualUnlock(data, size);
+        VirtualFree(data, 0, MEM_RELEASE);
+#else
+        if (locked)
+            munlock(data, size);
+        munmap(data, size);
+#endif
+    }
+
+    uint8 *getData() const noexcept { return static_cast<uint8 *>(data); }
+    size_t getSize() const noexcept { return size; }
+    const std::shared_ptr<Statistics> &getStatistics() const noexcept { return statistics; }
+
+    /** First fit from the free ranges, nullptr when none is large enough. */
+    uint8 *take(size_t bytes)
+    {
+        const ScopedLock sl(freeLock);
+        for (auto range = freeRanges.begin(); range != freeRanges.end(); ++range)
+        {
+            if (range->second < bytes)
+                continue;
+            const size_t offset = range->first, length = range->second;
+            freeRanges.erase(range);
+            if (length > bytes)
+                freeRanges.emplace(offset + bytes, length - bytes);
+            return getData() + offset;
+        }
+        return nullptr;
+    }
+
+    /** Takes back the range of a freed block, merged with the free ranges around it. A chunk
+        of one long recording is unmapped with it instead. */
+    void give(uint8 *block, size_t bytes)
+    {
+        if (!shared)
+            return;
+        // free ranges stay zeroed, so a block taken from them comes zeroed like a new chunk
+        memset(block, 0, bytes);
+        const ScopedLock sl(freeLock);
+        size_t offset = (size_t)(block - getData());
+        auto next = freeRanges.lower_bound(offset);
+        if (next != freeRanges.end() && next->first == offset + bytes)
+        {
+            bytes += next->second;
+            next = freeRanges.erase(next);
+        }
+        if (next != freeRanges.begin())
+        {
+            auto previous = std::prev(next);
+            if (previous->first + previous->second == offset)
+            {
+                offset = previous->first;
+                bytes += previous->second;
+                freeRanges.erase(previous);
+            }
+        }
+        freeRanges.emplace(offset, bytes);
+    }
+
+private:
+    void *data = nullptr;
+    size_t size;
+    bool shared, locked = false, hugePageBacked = false;
+    std::shared_ptr<Statistics> statistics;
+    CriticalSection freeLock;
+    // offset and length of every range no block uses
+    std::map<size_t, size_t> freeRanges;
+
+    JUCE_DECLARE_NON_COPYABLE(Chunk)
+};
+
+rmpSampleArena::Block &rmpSampleArena::Block::operator=(Block &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        data = other.data;
+        size = other.size;
+        chunk = std::move(other.chunk);
+        other.data = nullptr;
+        other.size = 0;
+    }
+    return *this;
+}
+
+rmpSampleArena::Block::~Block()
+{
+    release();
+}
+
+void rmpSampleArena::Block::release()
+{
+    if (!chunk)
+        return;
+    chunk->getStatistics()->usedBytes -= (int64)size;
+    chunk->give(data, size);
+    chunk.reset();
+}
+
+rmpSampleArena::rmpSampleArena()
+{
+    statistics = std::make_shared<Statistics>();
+    const String hugePageSetting = SystemStats::getEnvironmentVariable("HYPERIA_HUGE_PAGES", "transparent").trim().toLowerCase();
+    if (hugePageSetting == "off")
+        hugePages = HugePages::off;
+    else if (hugePageSetting == "explicit")
+        hugePages = HugePages::explicitPool;
+    lockPages = SystemStats::getEnvironmentVariable("HYPERIA_SAMPLE_MLOCK", "0").getIntValue() != 0;
+}
+
+std::shared_ptr<rmpSampleArena::Chunk> rmpSampleArena::map(size_t bytes, bool shared)
+{
+    // whole huge pages, so the tail of the chunk gets one as well
+    const size_t hugePageBytes = 2 << 20;
+    bytes = (bytes + hugePageBytes - 1) / hugePageBytes * hugePageBytes;
+    std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>(bytes, shared, hugePages, lockPages, statistics);
+    if (!chunk->getData())
+        return nullptr;
+    return chunk;
+}
+
+rmpSampleArena::Block rmpSampleArena::allocate(size_t bytes)
+{
+    Block block;
+    bytes = jmax((size_t)1, (bytes + alignment - 1) / alignment * alignment);
+    const ScopedLock sl(lock);
+    if (bytes > chunkBytes / 2)
+    {
+        // a long recording gets a chunk of its own instead of wasting the rest of the current one
+        block.chunk = map(bytes, false);
+        if (!block.chunk)
+            throw std::bad_alloc();
+        block.data = block.chunk->getData();
+    }
+    else
+    {
+        // space freed by evicted or unloaded zones is filled before another chunk is mapped
+        for (auto entry = sharedChunks.begin(); entry != sharedChunks.end() && !block.data;)
+        {
+            std::shared_ptr<Chunk> chunk = entry->lock();
+            if (!chunk)
+            {
+                entry = sharedChunks.erase(entry);
+                continue;
+            }
+            if ((block.data = chunk->take(bytes)) != nullptr)
+                block.chunk = std::move(chunk);
+            ++entry;
+        }
+        if (!block.data)
+        {
+            current = map(chunkBytes, true);
+            if (!current)
+                throw std::bad_alloc();
+            sharedChunks.push_back(current);
+            block.chunk = current;
+            block.data = current->take(bytes);
+        }
+    }
+    block.size = bytes;
+    statistics->usedBytes += (int64)bytes;
+    return block;
+}
+
+rmpSampleArena::Residency &rmpSampleArena::Residency::operator=(Residency &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        data = other.data;
+        size = other.size;
+        locked = other.locked;
+        statistics = std::move(other.statistics);
+        other.data = nullptr;
+        other.size = 0;
+        other.locked = false;
+    }
+    return *this;
+}
+
+rmpSampleArena::Residency::~Residency()
+{
+    release();
+}
+
+void rmpSampleArena::Residency::release()
+{
+    if (!locked)
+        return;
+#if JUCE_WINDOWS
+    VirtualUnlock(const_cast<uint8 *>(data), size);
+#else
+    munlock(data, size);
+#endif
+    statistics->lockedBytes -= (int64)size;
+    locked = false;
+}
+
+rmpSampleArena::Residency rmpSampleArena::makeResident(const void *data, size_t bytes)
+{
+    Residency residency;
+    if (bytes == 0)
+        return residency;
+#if JUCE_WINDOWS
+    const size_t pageBytes = 4096;
+#else
+    const size_t pageBytes = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    // whole pages, madvise wants an aligned start
+    const uint8 *first = reinterpret_cast<const uint8 *>((uintptr_t)data & ~(uintptr_t)(pageBytes - 1));
+    const size_t length = (size_t)(static_cast<const uint8 *>(data) + bytes - first);
+#if !JUCE_WINDOWS
+    // the kernel reads the whole range ahead instead of one fault at a time below
+    madvise(const_cast<uint8 *>(first), length, MADV_WILLNEED);
+#endif
+    const volatile uint8 *pages = first;
+    for (size_t offset = 0; offset < length; offset += pageBytes)
+        (void)pages[offset];
+
+    residency.data = first;
+    residency.size = length;
+    residency.statistics = statistics;
+    if (lockPages)
+    {
+#if JUCE_WINDOWS
+        residency.locked = VirtualLock(const_cast<uint8 *>(first), length) != 0;
+#else
+        residency.locked = mlock(first, length) == 0;
+#endif
+        if (residency.locked)
+            statistics->lockedBytes += (int64)length;
+        else
+            ++statistics->lockFailures;
+    }
+    return residency;
+}
+
+String rmpSampleArena::describe() const
+{
+    const Statistics &s = *statistics;
+    String report = "sample arena: " + String((double)s.usedBytes.load() / 1048576.0, 1) + " MB used in "
+        + String(s.chunks.load()) + " chunks of " + String((double)s.mappedBytes.load() / 1048576.0, 1) + " MB, "
+        + String((double)s.hugePageBytes.load() / 1048576.0, 1) + " MB on huge pages";
+    if (lockPages)
+        report << ", " << String((double)s.lockedBytes.load() / 1048576.0, 1) << " MB locked, "
+            << String(s.lockFailures.load()) << " lock failures";
+    return report;
+}
@@ -0,0 +1,125 @@
+/*
+  ==============================================================================
+
+    SampleArena.h
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/** Large page-aligned chunks holding the frames of every zone in the process.
+
+    Zones are carved out of chunks of chunkBytes one after the other, so a voice walking
+    through a recording, and through the recordings of neighbouring notes, stays within a
+    few pages. The space of a freed zone goes back to its chunk and is reused first fit, so
+    levels evicted and built again do not keep mapping new chunks. Every page of a chunk is touched when the chunk is mapped, so the first note
+    on a zone nobody played yet finds its frames resident instead of faulting them in on the
+    audio thread.
+
+    On Linux chunks are backed by transparent huge pages, or by explicit ones from the
+    hugetlb pool with HYPERIA_HUGE_PAGES=explicit, and Windows uses large pages when the
+    process holds the privilege for them. HYPERIA_HUGE_PAGES=off keeps normal pages. With
+    HYPERIA_SAMPLE_MLOCK=1 chunks are also locked into memory, so the system never pages
+    them out; chunks the lock limit doesn't allow for are counted in the statistics and
+    stay unlocked.
+
+    A chunk is returned to the system once the last zone in it is freed, except the one
+    mapped last.
+
+    Zones mapped from the sample store live in the page cache rather than in a chunk.
+    makeResident() prefaults and locks them in the same way.
+*/
+class rmpSampleArena
+{
+public:
+    rmpSampleArena();
+    ~rmpSampleArena() = default;
+
+    class Chunk;
+    struct Statistics
+    {
+        std::atomic<int64> mappedBytes { 0 }, usedBytes { 0 }, lockedBytes { 0 }, hugePageBytes { 0 };
+        std::atomic<int> chunks { 0 }, lockFailures { 0 };
+    };
+
+    /** Memory of one zone, the chunk it lies in stays mapped while any block uses it.
+        The memory comes zeroed. */
+    class Block
+    {
+    public:
+        Block() = default;
+        Block(Block &&other) noexcept { *this = std::move(other); }
+        Block &operator=(Block &&other) noexcept;
+        ~Block();
+
+        uint8 *getData() const noexcept { return data; }
+        size_t getSize() const noexcept { return size; }
+
+    private:
+        friend class rmpSampleArena;
+        /** Hands the memory back to the chunk. */
+        void release();
+
+        uint8 *data = nullptr;
+        size_t size = 0;
+        std::shared_ptr<Chunk> chunk;
+
+        JUCE_DECLARE_NON_COPYABLE(Block)
+    };
+
+    /** Memory outside the arena kept resident, unlocked again when this goes. It must go
+        before the memory is unmapped. */
+    class Residency
+    {
+    public:
+        Residency() = default;
+        Residency(Residency &&other) noexcept { *this = std::move(other); }
+        Residency &operator=(Residency &&other) noexcept;
+        ~Residency();
+
+    private:
+        friend class rmpSampleArena;
+        void release();
+
+        const uint8 *data = nullptr;
+        size_t size = 0;
+        bool locked = false;
+        std::shared_ptr<Statistics> statistics;
+
+        JUCE_DECLARE_NON_COPYABLE(Residency)
+    };
+
+    /** Not for the audio thread, mapping a new chunk prefaults all of its pages. */
+    Block allocate(size_t bytes);
+    /** Faults in every page of a range, such as a zone in a file mapping, and locks it with
+        HYPERIA_SAMPLE_MLOCK. Not for the audio thread. */
+    Residency makeResident(const void *data, size_t bytes);
+
+    /** Usage and locking figures, one line for the log. */
+    String describe() const;
+
+    static const size_t chunkBytes = 32 << 20;
+    static const size_t alignment = 64;
+
+private:
+    /** A shared chunk takes the zones that fit in it, the others get a chunk of their own. */
+    std::shared_ptr<Chunk> map(size_t bytes, bool shared);
+
+    enum class HugePages { off, transparent, explicitPool };
+    HugePages hugePages = HugePages::transparent;
+    bool lockPages = false;
+
+    CriticalSection lock;
+    std::vector<std::weak_ptr<Chunk>> sharedChunks;
+    // the chunk mapped last stays even when empty, so loads do not map and unmap it in turn
+    std::shared_ptr<Chunk> current;
+    std::shared_ptr<Statistics> statistics;
+
+    JUCE_DECLARE_NON_COPYABLE(rmpSampleArena)
+};
@@ -0,0 +1,149 @@
+/*
+  ==============================================================================
+
+    SampleManager.cpp
+
+  ==============================================================================
+*/
+
+#include "SampleManager.h"
+#include <algorithm>
+
+rmpSampleManager::rmpSampleManager() : Thread("rmp sample manager")
+{
+    const String megabytes = SystemStats::getEnvironmentVariable("HYPERIA_SAMPLE_BUDGET_MB", "");
+    if (megabytes.isNotEmpty())
+        budget.store((int64)megabytes.getLargeIntValue() * 1048576, std::memory_order_relaxed);
+    startThread(2);
+}
+
+rmpSampleManager::~rmpSampleManager()
+{
+    stopThread(10000);
+}
+
+std::shared_ptr<rmpSample> rmpSampleManager::add(const std::shared_ptr<rmpSample> &sample, const String &key)
+{
+    const ScopedLock work(workLock);
+    if (key.isNotEmpty())
+        if (std::shared_ptr<rmpSample> existing = find(key))
+            return existing;
+    // a load cannot wait for the next look of the manager thread, it would be over budget by then
+    const int64 limit = getBudget();
+    if (limit > 0 && enforceBudget() + (int64)sample->getSizeInBytes() > limit)
+        return nullptr;
+    {
+        const ScopedLock sl(samplesLock);
+        if (key.isNotEmpty())
+        {
+            shared[key] = sample;
+            sample->setKey(key);
+        }
+        samples.push_back(sample);
+    }
+    residentBytes.fetch_add((int64)sample->getSizeInBytes(), std::memory_order_relaxed);
+    notify();
+    return sample;
+}
+
+std::shared_ptr<rmpSample> rmpSampleManager::find(const String &key)
+{
+    const ScopedLock sl(samplesLock);
+    auto entry = shared.find(key);
+    if (entry == shared.end())
+        return nullptr;
+    return entry->second.lock();
+}
+
+void rmpSampleManager::setBudget(int64 bytes)
+{
+    budget.store(jmax((int64)0, bytes), std::memory_order_relaxed);
+    notify();
+}
+
+std::shared_ptr<rmpSample> rmpSampleManager::takeNext()
+{
+    const ScopedLock sl(samplesLock);
+    samples.erase(std::remove_if(samples.begin(), samples.end(),
+        [](const std::weak_ptr<rmpSample> &sample) { return sample.expired(); }), samples.end());
+    for (auto entry = shared.begin(); entry != shared.end();)
+        entry = entry->second.expired() ? shared.erase(entry) : std::next(entry);
+
+    std::shared_ptr<rmpSample> next;
+    for (auto entry = samples.begin(); entry != samples.end(); ++entry)
+    {
+        std::shared_ptr<rmpSample> sample = entry->lock();
+        if (!sample || sample->isComplete())
+            continue;
+        if (sample->isRequested())
+            return sample;
+        // evicted recordings wait until a voice wants them again
+        if (!next && !sample->isEvicted())
+            next = sample;
+    }
+    return next;
+}
+
+int64 rmpSampleManager::enforceBudget()
+{
+    std::vector<std::shared_ptr<rmpSample>> alive;
+    {
+        const ScopedLock sl(samplesLock);
+        for (auto entry = samples.begin(); entry != samples.end(); ++entry)
+            if (std::shared_ptr<rmpSample> sample = entry->lock())
+                alive.push_back(sample);
+    }
+    int64 resident = 0;
+    for (auto sample = alive.begin(); sample != alive.end(); ++sample)
+        resident += (int64)(*sample)->getSizeInBytes();
+
+    const int64 limit = budget.load(std::memory_order_relaxed);
+    if (limit > 0 && resident > limit)
+    {
+        std::sort(alive.begin(), alive.end(), [](const std::shared_ptr<rmpSample> &a, const std::shared_ptr<rmpSample> &b) {
+            return a->getLastUsed() < b->getLastUsed();
+        });
+        // upper levels go first, a voice reading them falls back to a finer level
+        for (int pass = 0; pass < 2 && resident > limit; ++pass)
+            for (auto sample = alive.begin(); sample != alive.end() && resident > limit; ++sample)
+                resident -= (int64)(*sample)->evict(pass == 1);
+    }
+    residentBytes.store(resident, std::memory_order_relaxed);
+    return resident;
+}
+
+void rmpSampleManager::buildNextLevel(rmpSample &sample)
+{
+    const int level = sample.getNumLevels();
+    // the stand-in is still in memory, the sample only publishes it again
+    const bool standIn = level == sample.getStandInLevel();
+    if (level < sample.getTargetLevels() && !standIn)
+    {
+        rmpSampleStore::Level stored = store.attach(sample.getKey(), sample.getPack(), level);
+        if (stored.data && sample.adoptLevel(level, std::move(stored.data)))
+            return;
+    }
+    if (sample.buildNextLevel() && !standIn && sample.getNumLevels() == level + 1)
+        store.publish(sample.getKey(), sample.getPack(), level, sample.getLevel(level), sample.getSampleRate(), sample.getSourceStart());
+}
+
+void rmpSampleManager::run()
+{
+    while (!threadShouldExit())
+    {
+        std::shared_ptr<rmpSample> sample;
+        {
+            const ScopedLock work(workLock);
+            sample = takeNext();
+            // one level at a time, so a recording a voice is waiting for can step in between
+            if (sample)
+                buildNextLevel(*sample);
+            enforceBudget();
+        }
+        if (!sample)
+        {
+            // pins change with the notes played, so the budget is looked at again now and then
+            wait(1000);
+        }
+    }
+}
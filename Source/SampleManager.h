@@ -0,0 +1,79 @@
+/*
+  ==============================================================================
+
+    SampleManager.h
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "SampleStore.h"
+#include "ZoneData.h"
+#include <map>
+#include <memory>
+#include <vector>
+
+/** Background thread owning the life of every loaded recording in the process.
+
+    It fills in mipmap levels after a recording is loaded, rebuilds levels that were
+    evicted and keeps the resident sample memory within a budget. One instance is shared by
+    every layer through a SharedResourcePointer, so it also serves as the cache through which
+    plugin instances loading the same pack share their recordings.
+
+    Work comes in this order: recordings a voice asked for with rmpSample::request(), then
+    missing levels of recordings in the order they were added. Whenever the resident total is
+    over budget the least recently played recordings that no voice has pinned give up their
+    upper levels, which the reader can do without, and then their level 0. Of those the
+    coarsest level stays as a stand-in the voices play until a request brings level 0 back
+    from the store or the pack. add() evicts the same way before registering, and only turns
+    away a recording that would not fit even once everything that can go is gone.
+
+    The budget is read from the HYPERIA_SAMPLE_BUDGET_MB environment variable, or set with
+    setBudget(); 0 means no limit.
+
+    Levels of shared recordings are first looked up in the rmpSampleStore, and the ones built
+    here are written to it for the other processes.
+*/
+class rmpSampleManager : private Thread
+{
+public:
+    rmpSampleManager();
+    ~rmpSampleManager();
+
+    /** Registers a recording, the manager only keeps a weak reference. With a key the
+        recording is also shared with later loads asking for the same key; if another one is
+        already registered under it that one is returned and should be used instead. Returns
+        nullptr when the recording does not fit in the budget. May wait for the level the
+        manager thread is building. */
+    std::shared_ptr<rmpSample> add(const std::shared_ptr<rmpSample> &sample, const String &key = String());
+    /** The recording registered under key while any instrument still holds it, else nullptr. */
+    std::shared_ptr<rmpSample> find(const String &key);
+
+    void setBudget(int64 bytes);
+    int64 getBudget() const noexcept { return budget.load(std::memory_order_relaxed); }
+    int64 getResidentBytes() const noexcept { return residentBytes.load(std::memory_order_relaxed); }
+
+    rmpSampleStore &getStore() noexcept { return store; }
+
+private:
+    void run() override;
+    /** Maps the next missing level from the store, or builds it and stores it. */
+    void buildNextLevel(rmpSample &sample);
+    /** The next recording with work to do, nullptr when everything is complete. */
+    std::shared_ptr<rmpSample> takeNext();
+    /** Evicts upper levels, then level 0, until the resident total is within budget,
+        returns that total. */
+    int64 enforceBudget();
+
+    // held while levels are built or evicted, by the manager thread and by add()
+    CriticalSection workLock;
+    CriticalSection samplesLock;
+    std::vector<std::weak_ptr<rmpSample>> samples;
+    std::map<String, std::weak_ptr<rmpSample>> shared;
+    std::atomic<int64> budget { 0 }, residentBytes { 0 };
+    rmpSampleStore store;
+    // keeps the arena, and the chunk it fills, alive between loads
+    SharedResourcePointer<rmpSampleArena> arena;
+};
@@ -0,0 +1,162 @@
+/*
+  ==============================================================================
+
+    SampleStore.cpp
+
+  ==============================================================================
+*/
+
+#include "SampleStore.h"
+#include "Log.h"
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+    // what precedes the key and the zone in a store file
+    struct StoreFileHeader
+    {
+        uint32 magic;
+        uint32 version;
+        // size and modification time of the pack, a pack replaced in place is decoded again
+        int64 packSize;
+        int64 packModified;
+        int32 level;
+        double sampleRate;
+        int32 sourceStart;
+        uint32 keyBytes;
+    };
+    const uint32 storeFileMagic = 0x53504d52; // "RMPS"
+    // raised whenever the header or the zone layout changes, older files are ignored
+    const uint32 storeFileVersion = 1;
+
+    size_t zoneOffset(size_t keyBytes) { return (sizeof(StoreFileHeader) + keyBytes + 15) & ~(size_t)15; }
+}
+
+rmpSampleStore::rmpSampleStore()
+{
+    const String path = SystemStats::getEnvironmentVariable("HYPERIA_SAMPLE_STORE", "");
+    if (path.isEmpty())
+        return;
+    directory = File(path);
+    if (!directory.isDirectory() && !directory.createDirectory())
+    {
+        SharedResourcePointer<rmpLog>()->write("sample store " + path + " cannot be created, recordings stay private");
+        return;
+    }
+    const String megabytes = SystemStats::getEnvironmentVariable("HYPERIA_SAMPLE_STORE_MB", "");
+    if (megabytes.isNotEmpty())
+        capacity = megabytes.getLargeIntValue() * 1048576;
+    // one lock per directory, so separate stores never wait for each other
+    lock.reset(new InterProcessLock("hyperia-store-" + String::toHexString(directory.getFullPathName().hashCode64())));
+}
+
+File rmpSampleStore::fileFor(const String &key, int level) const
+{
+    // the key itself is kept in the file, a hash collision is caught when attaching
+    return directory.getChildFile(String::toHexString(key.hashCode64()) + "-" + String(level) + ".rmpz");
+}
+
+rmpSampleStore::Level rmpSampleStore::attach(const String &key, const File &pack, int level) const
+{
+    Level stored;
+    if (!isEnabled() || key.isEmpty())
+        return stored;
+    const File file = fileFor(key, level);
+    if (!file.existsAsFile())
+        return stored;
+    std::shared_ptr<const MemoryMappedFile> mapping = std::make_shared<MemoryMappedFile>(file, MemoryMappedFile::readOnly);
+    if (mapping->getData() == nullptr || mapping->getSize() < sizeof(StoreFileHeader))
+        return stored;
+
+    StoreFileHeader header;
+    memcpy(&header, mapping->getData(), sizeof(header));
+    const char *storedKey = static_cast<const char *>(mapping->getData()) + sizeof(header);
+    const std::string expectedKey = key.toStdString();
+    if (header.magic != storeFileMagic || header.version != storeFileVersion
+        || header.packSize != pack.getSize() || header.packModified != pack.getLastModificationTime().toMilliseconds()
+        || header.level != level || header.keyBytes != expectedKey.size()
+        || sizeof(header) + header.keyBytes > mapping->getSize()
+        || memcmp(storedKey, expectedKey.data(), expectedKey.size()) != 0)
+        return stored;
+
+    stored.data = rmpZoneData::fromMapping(mapping, zoneOffset(header.keyBytes));
+    stored.sampleRate = header.sampleRate;
+    stored.sourceStart = header.sourceStart;
+    {
+        // prune() goes by when a file was last mapped, which the access time does not tell
+        // reliably under relatime or noatime
+        InterProcessLock::ScopedLockType scopedLock(*lock);
+        if (scopedLock.isLocked())
+            file.setLastModificationTime(Time::getCurrentTime());
+    }
+    return stored;
+}
+
+void rmpSampleStore::publish(const String &key, const File &pack, int level, const rmpZoneData &data, double sampleRate, int sourceStart)
+{
+    // a mapped zone came from the store in the first place
+    if (!isEnabled() || key.isEmpty() || data.isMapped())
+        return;
+    InterProcessLock::ScopedLockType scopedLock(*lock);
+    if (!scopedLock.isLocked())
+        return;
+    const File file = fileFor(key, level);
+    if (file.existsAsFile())
+        return;
+
+    const std::string keyBytes = key.toStdString();
+    const File temporary = file.getSiblingFile(file.getFileName() + ".part");
+    // with the lock held a part file is what a writer that died left behind, and
+    // FileOutputStream would append to it
+    temporary.deleteFile();
+    bool written;
+    {
+        FileOutputStream out(temporary);
+        if (out.failedToOpen())
+            return;
+        StoreFileHeader header = {};
+        header.magic = storeFileMagic;
+        header.version = storeFileVersion;
+        header.packSize = pack.getSize();
+        header.packModified = pack.getLastModificationTime().toMilliseconds();
+        header.level = level;
+        header.sampleRate = sampleRate;
+        header.sourceStart = sourceStart;
+        header.keyBytes = (uint32)keyBytes.size();
+        out.write(&header, sizeof(header));
+        out.write(keyBytes.data(), keyBytes.size());
+        const uint8 padding[16] = {};
+        out.write(padding, zoneOffset(keyBytes.size()) - sizeof(header) - keyBytes.size());
+        data.writeTo(out);
+        out.flush();
+        // a full disk leaves a short file, which must not be moved into place
+        written = out.getStatus().wasOk();
+    }
+    // readers look for the final name only, so they never see a file being written
+    if (!written || !temporary.moveFileTo(file))
+        temporary.deleteFile();
+    if (capacity > 0)
+        prune();
+}
+
+void rmpSampleStore::prune()
+{
+    Array<File> files = directory.findChildFiles(File::findFiles, false, "*.rmpz");
+    std::vector<File> byAge(files.begin(), files.end());
+    int64 total = 0;
+    for (auto file = byAge.begin(); file != byAge.end(); ++file)
+        total += file->getSize();
+    if (total <= capacity)
+        return;
+    std::sort(byAge.begin(), byAge.end(), [](const File &a, const File &b) {
+        return a.getLastModificationTime().toMilliseconds() < b.getLastModificationTime().toMilliseconds();
+    });
+    // a process mapping a deleted file keeps its pages until it unmaps them
+    for (auto file = byAge.begin(); file != byAge.end() && total > capacity; ++file)
+    {
+        const int64 size = file->getSize();
+        if (file->deleteFile())
+            total -= size;
+    }
+}
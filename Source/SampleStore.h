@@ -0,0 +1,59 @@
+/*
+  ==============================================================================
+
+    SampleStore.h
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "ZoneData.h"
+#include <memory>
+
+/** Decoded recordings shared between processes through memory mapped files.
+
+    Several plugin hosts on one machine loading the same pack would each hold a private
+    copy of every recording. With a store directory set in HYPERIA_SAMPLE_STORE, each level
+    is written there once by the first process that builds it, and every other process maps
+    the file read-only instead of decoding the pack. Pointing it at a tmpfs such as /dev/shm
+    makes it plain shared memory.
+
+    Files are written under a lock held across processes and moved into place in one step,
+    so a reader never maps a partial file. HYPERIA_SAMPLE_STORE_MB caps the directory; past
+    it the files mapped least recently are deleted, which processes still mapping them don't
+    notice. Mapping a file sets its modification time, which is what the files are sorted by. Without a cap the files stay until the directory is cleared.
+*/
+class rmpSampleStore
+{
+public:
+    rmpSampleStore();
+    ~rmpSampleStore() = default;
+
+    bool isEnabled() const noexcept { return lock != nullptr; }
+
+    /** A level as another process stored it, data is nullptr when there is none. */
+    struct Level
+    {
+        std::unique_ptr<const rmpZoneData> data;
+        double sampleRate = 0.0;
+        int sourceStart = 0;
+    };
+    /** The stored level of a recording decoded from pack, if the pack is still the one the
+        level was built from. Records the use for prune(). */
+    Level attach(const String &key, const File &pack, int level) const;
+    /** Writes a level for the other processes, unless the store holds it already. */
+    void publish(const String &key, const File &pack, int level, const rmpZoneData &data, double sampleRate, int sourceStart);
+
+private:
+    File fileFor(const String &key, int level) const;
+    /** Deletes the least recently mapped files until the directory fits its cap, with the lock held. */
+    void prune();
+
+    File directory;
+    int64 capacity = 0;
+    std::unique_ptr<InterProcessLock> lock;
+
+    JUCE_DECLARE_NON_COPYABLE(rmpSampleStore)
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include <atomic>
+
+/** Per-sample smoothing of a single effect parameter.
+
+    The message thread only publishes a new target with setTargetValue(), the audio
+    thread picks it up at the start of the next block and ramps towards it. While the
+    value is steady isSmoothing() is false and effects can keep using a plain scalar,
+    so an unmoved parameter costs one comparison per block.
+*/
+class rmpSmoothedParam
+{
+public:
+    enum class Ramp { linear, exponential };
+
+    rmpSmoothedParam(Ramp _ramp = Ramp::linear, float initialValue = 0.0f)
+    {
+        ramp = _ramp;
+        target = initialValue;
+        rampTarget = current = initialValue;
+    }
+    ~rmpSmoothedParam() = default;
+
+    /** Sets the ramp length. A ramp under way carries on to its target over the new
+        length, from where it got to. */
+    void reset(double sampleRate, double rampLengthSeconds)
+    {
+        jassert(sampleRate > 0.0);
+        rampLength = jmax(1, (int)(sampleRate * rampLengthSeconds));
+        // an exponential ramp covers 60 dB of the distance before snapping to the target
+        decay = (float)std::pow(0.001, 1.0 / rampLength);
+        // update() only starts a ramp when the target moves, so a stopped one would stay halfway
+        if (countdown > 0)
+        {
+            countdown = rampLength;
+            step = (rampTarget - current) / (float)rampLength;
+        }
+    }
+
+    /** Can be called from any thread, the ramp starts on the next audio block. */
+    void setTargetValue(float newValue) noexcept { target.store(newValue, std::memory_order_relaxed); }
+    float getTargetValue() const noexcept { return target.load(std::memory_order_relaxed); }
+    float getCurrentValue() const noexcept { return current; }
+
+    /** Jumps straight to a value without a ramp, audio thread only. */
+    void setCurrentAndTargetValue(float newValue) noexcept
+    {
+        target.store(newValue, std::memory_order_relaxed);
+        rampTarget = current = newValue;
+        countdown = 0;
+        started = true;
+    }
+
+    bool isSmoothing() noexcept
+    {
+        update();
+        return countdown > 0;
+    }
+
+    /** Writes the next numSamples values to dest and advances the ramp. */
+    void fillRamp(float *dest, int numSamples) noexcept
+    {
+        update();
+        int rampSamples = jmin(countdown, numSamples);
+        if (ramp == Ramp::linear)
+        {
+            const float start = current;
+            for (int i = 0; i < rampSamples; ++i)
+                dest[i] = start + step * (float)(i + 1);
+        }
+        else
+        {
+            float distance = current - rampTarget;
+            for (int i = 0; i < rampSamples; ++i)
+            {
+                distance *= decay;
+                dest[i] = rampTarget + distance;
+            }
+        }
+        advance(rampSamples);
+        if (rampSamples < numSamples)
+            FloatVectorOperations::fill(dest + rampSamples, current, numSamples - rampSamples);
+    }
+
+    /** Skips numSamples values of the ramp without producing them. */
+    void skip(int numSamples) noexcept
+    {
+        update();
+        advance(jmin(countdown, numSamples));
+    }
+
+    /** Multiplies all channels of the range by the ramp, or by the steady value. */
+    void applyGain(AudioBuffer<float> &buffer, int startSample, int numSamples) noexcept
+    {
+        if (!isSmoothing())
+        {
+            if (current != 1.0f)
+                buffer.applyGain(startSample, numSamples, current);
+            return;
+        }
+        float rampBuffer[rampChunk];
+        while (numSamples > 0)
+        {
+            const int chunk = jmin(numSamples, (int)rampChunk);
+            fillRamp(rampBuffer, chunk);
+            for (int channel = 0; channel < buffer.getNumChannels(); ++channel)
+                FloatVectorOperations::multiply(buffer.getWritePointer(channel, startSample), rampBuffer, chunk);
+            startSample += chunk;
+            numSamples -= chunk;
+        }
+    }
+
+    /** Largest block a stack ramp buffer should hold, longer blocks are processed in pieces. */
+    static const int rampChunk = 256;
+
+private:
+    void update() noexcept
+    {
+        const float newTarget = target.load(std::memory_order_relaxed);
+        if (!started)
+        {
+            // the value set while the effect was built is the starting point, not a ramp
+            started = true;
+            rampTarget = current = newTarget;
+            return;
+        }
+        if (newTarget == rampTarget)
+            return;
+        rampTarget = newTarget;
+        countdown = rampLength;
+        step = (rampTarget - current) / (float)rampLength;
+    }
+
+    void advance(int numSamples) noexcept
+    {
+        if (numSamples <= 0)
+            return;
+        countdown -= numSamples;
+        if (countdown <= 0)
+        {
+            countdown = 0;
+            current = rampTarget;
+        }
+        else if (ramp == Ramp::linear)
+            current += step * (float)numSamples;
+        else
+            current = rampTarget + (current - rampTarget) * std::pow(decay, (float)numSamples);
+    }
+
+    Ramp ramp;
+    std::atomic<float> target;
+    float current, rampTarget;
+    float step = 0.0f, decay = 0.0f;
+    int rampLength = 1, countdown = 0;
+    bool started = false;
+};
@@ -0,0 +1,106 @@
+/*
+  ==============================================================================
+
+    SynthReclaimer.cpp
+
+  ==============================================================================
+*/
+
+#include "SynthReclaimer.h"
+
+#if JUCE_LINUX || JUCE_WINDOWS
+ #include <malloc.h>
+#endif
+
+rmpSynthReclaimer::rmpSynthReclaimer() : Thread("rmp synth reclaimer")
+{
+    startThread(1);
+}
+
+rmpSynthReclaimer::~rmpSynthReclaimer()
+{
+    // freeing on the message thread would stall the host closing the plugin
+    draining.store(true);
+    notify();
+    waitForThreadToExit(10000);
+    stopThread(1000);
+}
+
+void rmpSynthReclaimer::retire(rmpSynth *synth, Epoch renderEpoch, Holder holder)
+{
+    if (!synth)
+        return;
+    Retired retired;
+    retired.synth.reset(synth);
+    retired.epoch = std::move(renderEpoch);
+    retired.holder = std::move(holder);
+    retired.waitingForHolder = retired.holder != nullptr;
+    retired.epochAtRetirement = retired.epoch ? retired.epoch->load(std::memory_order_seq_cst) : 0;
+    {
+        const ScopedLock sl(queueLock);
+        queue.push_back(std::move(retired));
+    }
+    notify();
+}
+
+bool rmpSynthReclaimer::isUnreferenced(Retired &retired) noexcept
+{
+    if (retired.waitingForHolder)
+    {
+        // still fading out, the epoch is only read once the holder has let go of it
+        if (retired.holder->load(std::memory_order_seq_cst) == retired.synth.get())
+            return false;
+        retired.waitingForHolder = false;
+        retired.epochAtRetirement = retired.epoch ? retired.epoch->load(std::memory_order_seq_cst) : 0;
+    }
+    // the synth pointer was swapped before the epoch was read: an even epoch means no
+    // callback was running, any change means the one that was running has returned
+    return !retired.epoch || (retired.epochAtRetirement & 1) == 0
+        || retired.epoch->load(std::memory_order_seq_cst) != retired.epochAtRetirement;
+}
+
+void rmpSynthReclaimer::trimHeap()
+{
+#if JUCE_LINUX
+    malloc_trim(0);
+#elif JUCE_WINDOWS
+    _heapmin();
+#endif
+}
+
+void rmpSynthReclaimer::run()
+{
+    while (!threadShouldExit())
+    {
+        // the last processor is gone, so no callback renders any of them anymore
+        const bool finishing = draining.load();
+        std::unique_ptr<rmpSynth> synth;
+        bool waiting = false;
+        {
+            const ScopedLock sl(queueLock);
+            for (auto retired = queue.begin(); retired != queue.end(); ++retired)
+            {
+                if (finishing || isUnreferenced(*retired))
+                {
+                    synth = std::move(retired->synth);
+                    queue.erase(retired);
+                    break;
+                }
+                waiting = true;
+            }
+        }
+        if (!synth)
+        {
+            if (finishing)
+                return;
+            // a callback lasts a few milliseconds at most
+            wait(waiting ? 5 : -1);
+            continue;
+        }
+        // small steps, with room for the rest of the process in between
+        while (!threadShouldExit() && synth->releaseSome())
+            Thread::yield();
+        synth.reset();
+        trimHeap();
+    }
+}
@@ -0,0 +1,62 @@
+/*
+  ==============================================================================
+
+    SynthReclaimer.h
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "rmpSynth.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/** Low priority thread taking apart the synths a processor has replaced.
+
+    A retired synth can hold hundreds of megabytes of recordings, and freeing them inline
+    would stall the message thread switching instruments, or the audio thread if it ended
+    up doing it. The processor hands the synth over together with its render epoch, a
+    counter the audio callback increments on entry and on exit. The synth is only touched
+    once the epoch shows that any callback that could have seen it has returned, and it is
+    then freed a voice or a layer at a time before the memory is handed back to the system.
+    A synth still fading out after a swap is also given a holder, the slot the audio
+    thread renders it from, and the epoch only starts counting once that slot has moved on.
+
+    One instance is shared by every processor through a SharedResourcePointer.
+*/
+class rmpSynthReclaimer : private Thread
+{
+public:
+    typedef std::shared_ptr<const std::atomic<uint32>> Epoch;
+    typedef std::shared_ptr<const std::atomic<rmpSynth *>> Holder;
+
+    rmpSynthReclaimer();
+    /** Lets the thread free what is still queued before it exits, only happens at unload. */
+    ~rmpSynthReclaimer();
+
+    /** Takes ownership of a synth the audio thread may still be rendering. */
+    void retire(rmpSynth *synth, Epoch renderEpoch, Holder holder = nullptr);
+
+private:
+    struct Retired
+    {
+        std::unique_ptr<rmpSynth> synth;
+        Epoch epoch;
+        Holder holder;
+        uint32 epochAtRetirement;
+        bool waitingForHolder;
+    };
+    /** True once no audio callback that started before the retirement, or before the
+        holder let go of the synth, is still running. */
+    static bool isUnreferenced(Retired &retired) noexcept;
+    static void trimHeap();
+    void run() override;
+
+    CriticalSection queueLock;
+    std::vector<Retired> queue;
+    // set at unload, when no processor is left to render what is queued
+    std::atomic<bool> draining { false };
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+/** Explicit state of a single voice: idle -> attack -> held -> releasing -> done.
+
+    Whatever can move a voice on (a note message, its envelope, its layers) posts an
+    event. The transition itself only updates a byte, the owner reacts to it where a
+    change can actually happen: after rendering, or while handling a note message.
+*/
+class rmpVoiceLifecycle
+{
+public:
+    enum class State : uint8 { idle, attack, held, releasing, done };
+    enum class Event : uint8 { noteOn, attackFinished, noteOff, finished };
+
+    rmpVoiceLifecycle() = default;
+    ~rmpVoiceLifecycle() = default;
+
+    State getState() const noexcept { return state; }
+    bool isDone() const noexcept { return state == State::done; }
+
+    void post(Event event) noexcept
+    {
+        const State next = transition(state, event);
+        if (next != state)
+        {
+            state = next;
+            changed = true;
+        }
+    }
+
+    /** Returns true once after any transition since the previous call. */
+    bool pollChange() noexcept
+    {
+        const bool result = changed;
+        changed = false;
+        return result;
+    }
+
+    void reset() noexcept
+    {
+        state = State::idle;
+        changed = false;
+    }
+
+private:
+    static State transition(State from, Event event) noexcept
+    {
+        switch (event)
+        {
+            case Event::noteOn:         return State::attack;
+            case Event::attackFinished: return (from == State::attack) ? State::held : from;
+            case Event::noteOff:        return (from == State::attack || from == State::held) ? State::releasing : from;
+            case Event::finished:       return (from == State::idle) ? from : State::done;
+        }
+        return from;
+    }
+
+    State state = State::idle;
+    bool changed = false;
+};
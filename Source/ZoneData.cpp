@@ -0,0 +1,773 @@
+/*
+  ==============================================================================
+
+    ZoneData.cpp
+
+  ==============================================================================
+*/
+
+#include "ZoneData.h"
+#include <limits>
+
+namespace
+{
+    const int riceEscape = 24;
+    const int partitionFrames = 256;
+
+    /** The fixed polynomial predictors for the frame at x, the i-th of its block. The order
+        is cut short at the start of a block. */
+    inline int64 predictAt(const int *x, int i, int order) noexcept
+    {
+        switch (jmin(order, i))
+        {
+        case 1: return x[-1];
+        case 2: return 2 * (int64)x[-1] - x[-2];
+        case 3: return 3 * (int64)x[-1] - 3 * (int64)x[-2] + x[-3];
+        default: return 0;
+        }
+    }
+    inline int64 predict(const int *x, int i, int order) noexcept { return predictAt(x + i, i, order); }
+
+    class BitWriter
+    {
+    public:
+        BitWriter(std::vector<uint8> &_out) : out(_out) {}
+
+        void write(uint32 value, int numBits)
+        {
+            accumulator = (accumulator << numBits) | (uint64)value;
+            pending += numBits;
+            while (pending >= 8)
+            {
+                pending -= 8;
+                out.push_back((uint8)(accumulator >> pending));
+            }
+        }
+        void writeOnes(int count)
+        {
+            for (; count > 16; count -= 16)
+                write(0xffff, 16);
+            write((1u << count) - 1, count);
+        }
+        void flush()
+        {
+            if (pending > 0)
+                write(0, 8 - pending);
+        }
+
+    private:
+        std::vector<uint8> &out;
+        uint64 accumulator = 0;
+        int pending = 0;
+    };
+
+    class BitReader
+    {
+    public:
+        BitReader(const uint8 *_data, uint64 _accumulator = 0, int _available = 0)
+            : data(_data), accumulator(_accumulator), available(_available) {}
+        /** Where reading stopped, a later reader carries on from there. */
+        void save(const uint8 *&savedData, uint64 &savedAccumulator, int &savedAvailable) const noexcept
+        {
+            savedData = data;
+            savedAccumulator = accumulator;
+            savedAvailable = available;
+        }
+
+        uint32 read(int numBits) noexcept
+        {
+            if (numBits == 0)
+                return 0;
+            refill();
+            available -= numBits;
+            return (uint32)(accumulator >> available) & (uint32)((1ull << numBits) - 1);
+        }
+        /** Counts a unary run and consumes its terminating zero, unless the run reaches limit. */
+        int readOnes(int limit) noexcept
+        {
+            int count = 0;
+            while (count < limit && read(1))
+                ++count;
+            return count;
+        }
+
+    private:
+        void refill() noexcept
+        {
+            while (available <= 56)
+            {
+                accumulator = (accumulator << 8) | *data++;
+                available += 8;
+            }
+        }
+
+        const uint8 *data;
+        uint64 accumulator = 0;
+        int available = 0;
+    };
+}
+
+rmpZoneData::rmpZoneData(const AudioBuffer<float> &source, Format _format)
+{
+    format = _format;
+    numChannels = source.getNumChannels();
+    numSamples = source.getNumSamples();
+    if (isCompressed())
+    {
+        channelBytes = 0;
+        compress(source, format == Format::compressed16 ? 16 : 24);
+        return;
+    }
+    channelBytes = (size_t)numSamples * (size_t)bytesPerSample(format);
+    storageBytes = (size_t)numChannels * channelBytes;
+    storage = SharedResourcePointer<rmpSampleArena>()->allocate(storageBytes);
+    bytes = storage.getData();
+
+    for (int channel = 0; channel < numChannels; ++channel)
+    {
+        const float *in = source.getReadPointer(channel);
+        uint8 *out = storage.getData() + (size_t)channel * channelBytes;
+        switch (format)
+        {
+        case Format::float32:
+            memcpy(out, in, channelBytes);
+            break;
+        case Format::int16:
+            for (int i = 0; i < numSamples; ++i)
+            {
+                const int16 value = (int16)jlimit(-32768, 32767, roundToInt(in[i] * 32768.0f));
+                memcpy(out + 2 * i, &value, 2);
+            }
+            break;
+        case Format::int24:
+            for (int i = 0; i < numSamples; ++i)
+            {
+                const int value = jlimit(-8388608, 8388607, roundToInt(in[i] * 8388608.0f));
+                out[3 * i] = (uint8)value;
+                out[3 * i + 1] = (uint8)(value >> 8);
+                out[3 * i + 2] = (uint8)(value >> 16);
+            }
+            break;
+        case Format::half:
+            for (int i = 0; i < numSamples; ++i)
+            {
+                const uint16 value = floatToHalf(in[i]);
+                memcpy(out + 2 * i, &value, 2);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void rmpZoneData::compress(const AudioBuffer<float> &source, int bits)
+{
+    const float scale = (float)(1 << (bits - 1));
+    const int maxValue = (1 << (bits - 1)) - 1;
+    std::vector<uint8> out;
+    BitWriter writer(out);
+    std::vector<int> frames(blockFrames);
+
+    for (int block = 0; block < getNumBlocks(); ++block)
+    {
+        blockOffsets.push_back((uint32)out.size());
+        const int start = block * blockFrames;
+        const int length = jmin(blockFrames, numSamples - start);
+        for (int channel = 0; channel < numChannels; ++channel)
+        {
+            const float *in = source.getReadPointer(channel, start);
+            int *x = frames.data();
+            for (int i = 0; i < length; ++i)
+                x[i] = jlimit(-maxValue - 1, maxValue, roundToInt(in[i] * scale));
+
+            // the order leaving the smallest residuals wins
+            int order = 0;
+            int64 bestCost = -1;
+            for (int candidate = 0; candidate <= 3; ++candidate)
+            {
+                int64 cost = 0;
+                for (int i = 0; i < length; ++i)
+                    cost += std::abs(x[i] - predict(x, i, candidate));
+                if (bestCost < 0 || cost < bestCost)
+                {
+                    bestCost = cost;
+                    order = candidate;
+                }
+            }
+            writer.write((uint32)order, 2);
+
+            for (int first = 0; first < length; first += partitionFrames)
+            {
+                const int count = jmin(partitionFrames, length - first);
+                uint32 residuals[partitionFrames];
+                uint64 sum = 0;
+                for (int i = 0; i < count; ++i)
+                {
+                    const int residual = (int)(x[first + i] - predict(x, first + i, order));
+                    residuals[i] = ((uint32)residual << 1) ^ (uint32)(residual >> 31);
+                    sum += residuals[i];
+                }
+                // the Rice parameter near log2 of the mean keeps the unary part short
+                int k = 0;
+                while (k < 30 && ((uint64)count << (k + 1)) <= sum)
+                    ++k;
+                writer.write((uint32)k, 5);
+                for (int i = 0; i < count; ++i)
+                {
+                    const uint32 quotient = residuals[i] >> k;
+                    if (quotient < (uint32)riceEscape)
+                    {
+                        writer.writeOnes((int)quotient);
+                        writer.write(0, 1);
+                        writer.write(residuals[i] & ((1u << k) - 1), k);
+                    }
+                    else
+                    {
+                        writer.writeOnes(riceEscape);
+                        writer.write(residuals[i], 32);
+                    }
+                }
+            }
+        }
+        // blocks start on a byte so each one can be decoded on its own
+        writer.flush();
+    }
+    blockOffsets.push_back((uint32)out.size());
+
+    // the reader fetches whole bytes ahead of what it consumes
+    storageBytes = out.size() + 8;
+    // arena memory comes zeroed, as the reader expects of the bytes past the end
+    storage = SharedResourcePointer<rmpSampleArena>()->allocate(storageBytes);
+    bytes = storage.getData();
+    if (!out.empty())
+        memcpy(storage.getData(), out.data(), out.size());
+}
+
+namespace
+{
+    // what precedes the block offsets and the frames in a written zone
+    struct MappedZoneHeader
+    {
+        uint32 magic;
+        uint8 format, reserved[3];
+        int32 numChannels, numSamples;
+        uint32 numOffsets;
+        uint64 channelBytes, storageBytes;
+    };
+    const uint32 mappedZoneMagic = 0x5a504d52; // "RMPZ"
+
+    size_t alignedTo16(size_t size) { return (size + 15) & ~(size_t)15; }
+}
+
+void rmpZoneData::writeTo(OutputStream &out) const
+{
+    MappedZoneHeader header = {};
+    header.magic = mappedZoneMagic;
+    header.format = (uint8)format;
+    header.numChannels = numChannels;
+    header.numSamples = numSamples;
+    header.numOffsets = (uint32)blockOffsets.size();
+    header.channelBytes = channelBytes;
+    header.storageBytes = storageBytes;
+    out.write(&header, sizeof(header));
+    if (!blockOffsets.empty())
+        out.write(blockOffsets.data(), blockOffsets.size() * sizeof(uint32));
+    // the frames start aligned, so float zones can be read through a plain pointer
+    const size_t headerBytes = sizeof(header) + blockOffsets.size() * sizeof(uint32);
+    const uint8 padding[16] = {};
+    out.write(padding, alignedTo16(headerBytes) - headerBytes);
+    out.write(bytes, storageBytes);
+}
+
+std::unique_ptr<rmpZoneData> rmpZoneData::fromMapping(std::shared_ptr<const MemoryMappedFile> file, size_t offset)
+{
+    jassert(offset % 16 == 0);
+    const size_t size = file ? file->getSize() : 0;
+    if (offset + sizeof(MappedZoneHeader) > size)
+        return nullptr;
+    const uint8 *base = static_cast<const uint8 *>(file->getData()) + offset;
+    MappedZoneHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (header.magic != mappedZoneMagic || header.format > (uint8)Format::compressed24
+        || header.numChannels < 1 || header.numSamples < 0)
+        return nullptr;
+    const size_t headerBytes = sizeof(header) + (size_t)header.numOffsets * sizeof(uint32);
+    if (offset + alignedTo16(headerBytes) + header.storageBytes > size)
+        return nullptr;
+
+    std::unique_ptr<rmpZoneData> zone(new rmpZoneData());
+    zone->format = (Format)header.format;
+    zone->numChannels = header.numChannels;
+    zone->numSamples = header.numSamples;
+    zone->channelBytes = (size_t)header.channelBytes;
+    zone->storageBytes = (size_t)header.storageBytes;
+    zone->blockOffsets.resize(header.numOffsets);
+    if (header.numOffsets > 0)
+        memcpy(zone->blockOffsets.data(), base + sizeof(header), (size_t)header.numOffsets * sizeof(uint32));
+    // the block reader fetches 8 bytes beyond the last block
+    if (zone->isCompressed() ? (int)header.numOffsets != zone->getNumBlocks() + 1 || zone->blockOffsets.back() + (size_t)8 > zone->storageBytes
+                             : zone->storageBytes < (size_t)zone->numChannels * zone->channelBytes)
+        return nullptr;
+    zone->bytes = base + alignedTo16(headerBytes);
+    zone->mapping = std::move(file);
+    // the first note on the zone must not wait for the disk
+    zone->residency = SharedResourcePointer<rmpSampleArena>()->makeResident(zone->bytes, zone->storageBytes);
+    return zone;
+}
+
+void rmpZoneData::decodeBlock(int block, float *const *dest) const noexcept
+{
+    BlockCursor cursor;
+    beginBlock(block, cursor);
+    decodeBlockPart(cursor, dest, std::numeric_limits<int>::max());
+}
+
+void rmpZoneData::beginBlock(int block, BlockCursor &cursor) const noexcept
+{
+    jassert(isCompressed() && block >= 0 && block < getNumBlocks());
+    cursor = BlockCursor();
+    cursor.block = block;
+    cursor.bits = bytes + blockOffsets[block];
+}
+
+bool rmpZoneData::decodeBlockPart(BlockCursor &cursor, float *const *dest, int numPartitions) const noexcept
+{
+    jassert(isCompressed() && cursor.block >= 0 && cursor.block < getNumBlocks());
+    const int64 startTicks = Time::getHighResolutionTicks();
+    const float scale = 1.0f / (float)(format == Format::compressed16 ? 1 << 15 : 1 << 23);
+    const int length = jmin(blockFrames, numSamples - cursor.block * blockFrames);
+    BitReader reader(cursor.bits, cursor.accumulator, cursor.available);
+    // the last frames of the partition before, which the predictor reaches back to
+    int x[maxOrder + partitionFrames];
+    int *const frames = x + maxOrder;
+
+    for (; numPartitions > 0 && cursor.channel < numChannels; --numPartitions)
+    {
+        if (cursor.frame == 0)
+            cursor.order = (int)reader.read(2);
+        const int first = cursor.frame;
+        const int count = jmin(partitionFrames, length - first);
+        const int k = (int)reader.read(5);
+        memcpy(x, cursor.history, sizeof(cursor.history));
+        for (int i = 0; i < count; ++i)
+        {
+            const int quotient = reader.readOnes(riceEscape);
+            uint32 value;
+            if (quotient < riceEscape)
+                value = ((uint32)quotient << k) | reader.read(k);
+            else
+                value = reader.read(32);
+            const int residual = (int)(value >> 1) ^ -(int)(value & 1);
+            frames[i] = (int)(predictAt(frames + i, first + i, cursor.order) + residual);
+        }
+        float *out = dest[cursor.channel] + first;
+        for (int i = 0; i < count; ++i)
+            out[i] = (float)frames[i] * scale;
+        memcpy(cursor.history, frames + count - maxOrder, sizeof(cursor.history));
+        cursor.frame += count;
+        if (cursor.frame >= length)
+        {
+            cursor.frame = 0;
+            ++cursor.channel;
+        }
+    }
+    reader.save(cursor.bits, cursor.accumulator, cursor.available);
+
+    const bool complete = cursor.channel >= numChannels;
+    if (complete)
+        blocksDecoded.fetch_add(1, std::memory_order_relaxed);
+    decodeTicks.fetch_add(Time::getHighResolutionTicks() - startTicks, std::memory_order_relaxed);
+    return complete;
+}
+
+rmpZoneData::Format rmpZoneData::formatFor(const String &storage, int sourceBitsPerSample)
+{
+    if (storage == "native")
+    {
+        if (sourceBitsPerSample <= 16)
+            return Format::int16;
+        if (sourceBitsPerSample == 24)
+            return Format::int24;
+        return Format::float32;
+    }
+    if (storage == "int16")
+        return Format::int16;
+    if (storage == "int24")
+        return Format::int24;
+    if (storage == "half")
+        return Format::half;
+    if (storage == "compressed")
+    {
+        // only integer frames are coded without loss, 32 bit and float sources stay float
+        if (sourceBitsPerSample <= 16)
+            return Format::compressed16;
+        if (sourceBitsPerSample == 24)
+            return Format::compressed24;
+        return Format::float32;
+    }
+    return Format::float32;
+}
+
+int rmpZoneData::bytesPerSample(Format format)
+{
+    switch (format)
+    {
+    case Format::int16: return 2;
+    case Format::int24: return 3;
+    case Format::half: return 2;
+    case Format::float32: return 4;
+    default: return 0;
+    }
+}
+
+const float *rmpZoneData::getFloatPointer(int channel, int startSample) const noexcept
+{
+    if (format != Format::float32)
+        return nullptr;
+    return reinterpret_cast<const float *>(bytes + (size_t)channel * channelBytes) + startSample;
+}
+
+void rmpZoneData::read(int channel, int startSample, int count, float *dest) const noexcept
+{
+    jassert(startSample >= 0 && startSample + count <= numSamples);
+    if (isCompressed())
+    {
+        // compressed zones need the state of an rmpZoneDecoder
+        jassertfalse;
+        FloatVectorOperations::clear(dest, count);
+        return;
+    }
+    const uint8 *in = bytes + (size_t)channel * channelBytes + (size_t)startSample * (size_t)bytesPerSample(format);
+    switch (format)
+    {
+    case Format::float32:
+        memcpy(dest, in, (size_t)count * sizeof(float));
+        break;
+    case Format::int16:
+        for (int i = 0; i < count; ++i)
+        {
+            int16 value;
+            memcpy(&value, in + 2 * i, 2);
+            dest[i] = (float)value * (1.0f / 32768.0f);
+        }
+        break;
+    case Format::int24:
+        for (int i = 0; i < count; ++i)
+        {
+            // build the sample in the top three bytes so the shift back sign-extends it
+            const int value = (int)((uint32)in[3 * i] << 8 | (uint32)in[3 * i + 1] << 16 | (uint32)in[3 * i + 2] << 24) >> 8;
+            dest[i] = (float)value * (1.0f / 8388608.0f);
+        }
+        break;
+    case Format::half:
+        for (int i = 0; i < count; ++i)
+        {
+            uint16 value;
+            memcpy(&value, in + 2 * i, 2);
+            dest[i] = halfToFloat(value);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void rmpZoneData::readAll(AudioBuffer<float> &dest) const
+{
+    dest.setSize(numChannels, numSamples);
+    if (!isCompressed())
+    {
+        for (int channel = 0; channel < numChannels; ++channel)
+            read(channel, 0, numSamples, dest.getWritePointer(channel));
+        return;
+    }
+    // the last block decodes a whole block's worth of frames, so blocks go through a scratch buffer
+    AudioBuffer<float> block(numChannels, blockFrames);
+    for (int b = 0; b < getNumBlocks(); ++b)
+    {
+        decodeBlock(b, block.getArrayOfWritePointers());
+        const int start = b * blockFrames;
+        for (int channel = 0; channel < numChannels; ++channel)
+            dest.copyFrom(channel, start, block, channel, 0, jmin(blockFrames, numSamples - start));
+    }
+}
+
+rmpSample::rmpSample(const AudioBuffer<float> &levelZero, double _sampleRate, int numLevels, rmpZoneData::Format _format)
+{
+    sampleRate = _sampleRate;
+    format = _format;
+    numSamples = levelZero.getNumSamples();
+    numChannels = levelZero.getNumChannels();
+    lastUsed.store(Time::getMillisecondCounter(), std::memory_order_relaxed);
+    targetLevels.store(jlimit(1, (int)maxLevels, numLevels), std::memory_order_relaxed);
+    publish(0, levelZero);
+    if (getTargetLevels() > 1)
+        pending.reset(new AudioBuffer<float>(levelZero));
+}
+
+rmpSample::rmpSample(std::unique_ptr<const rmpZoneData> levelZero, double _sampleRate, int numLevels)
+{
+    sampleRate = _sampleRate;
+    format = levelZero->getFormat();
+    numSamples = levelZero->getNumSamples();
+    numChannels = levelZero->getNumChannels();
+    lastUsed.store(Time::getMillisecondCounter(), std::memory_order_relaxed);
+    targetLevels.store(jlimit(1, (int)maxLevels, numLevels), std::memory_order_relaxed);
+    publish(0, std::move(levelZero));
+}
+
+void rmpSample::publish(int level, const AudioBuffer<float> &data)
+{
+    publish(level, std::unique_ptr<const rmpZoneData>(new rmpZoneData(data, format)));
+}
+
+void rmpSample::publish(int level, std::unique_ptr<const rmpZoneData> data)
+{
+    residentBytes.fetch_add(data->getSizeInBytes(), std::memory_order_relaxed);
+    levels[level] = std::move(data);
+    // readers only look at levels below the published count
+    readyLevels.store(level + 1, std::memory_order_release);
+}
+
+bool rmpSample::adoptLevel(int level, std::unique_ptr<const rmpZoneData> data)
+{
+    if (level != getNumLevels() || level >= getTargetLevels() || level == getStandInLevel() || data->getFormat() != format
+        || data->getNumChannels() != numChannels || (level == 0 && data->getNumSamples() != numSamples))
+        return false;
+    // the next level is made from this one, not from what was pending
+    pending.reset();
+    publish(level, std::move(data));
+    if (level + 1 >= getTargetLevels())
+    {
+        evicted.store(false, std::memory_order_relaxed);
+        requested.store(false, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+bool rmpSample::pin() const noexcept
+{
+    int current = pins.load(std::memory_order_relaxed);
+    do
+    {
+        if (current < 0)
+            return false;
+    } while (!pins.compare_exchange_weak(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed));
+    // once pinned the levels stay, but there may be nothing left to read
+    if (getNumLevels() == 0 && getStandInLevel() < 0)
+    {
+        unpin();
+        return false;
+    }
+    lastUsed.store(Time::getMillisecondCounter(), std::memory_order_relaxed);
+    return true;
+}
+
+int rmpSample::levelToRead(int wanted) const noexcept
+{
+    const int ready = getNumLevels();
+    if (ready > 0)
+        return jmin(wanted, ready - 1);
+    const int standIn = getStandInLevel();
+    // the stand-in is only given up after the levels up to it are published again
+    return standIn >= 0 ? standIn : jmin(wanted, getNumLevels() - 1);
+}
+
+bool rmpSample::buildNextLevel()
+{
+    const int level = readyLevels.load(std::memory_order_relaxed);
+    if (level == 0)
+    {
+        AudioBuffer<float> reloaded;
+        if (!reloader || !reloader(reloaded) || reloaded.getNumSamples() != numSamples || reloaded.getNumChannels() != numChannels)
+        {
+            // the pack is gone or changed, notes on this recording keep playing the stand-in
+            targetLevels.store(0, std::memory_order_relaxed);
+            requested.store(false, std::memory_order_relaxed);
+            return false;
+        }
+        publish(0, reloaded);
+        if (getTargetLevels() > 1)
+            pending.reset(new AudioBuffer<float>(std::move(reloaded)));
+        return true;
+    }
+    if (level == getStandInLevel())
+    {
+        // the stand-in is this level already, it only has to be published again
+        pending.reset();
+        readyLevels.store(level + 1, std::memory_order_release);
+        standInLevel.store(-1, std::memory_order_release);
+        if (level + 1 >= getTargetLevels())
+        {
+            evicted.store(false, std::memory_order_relaxed);
+            requested.store(false, std::memory_order_relaxed);
+        }
+        return true;
+    }
+    if (level >= getTargetLevels())
+    {
+        pending.reset();
+        evicted.store(false, std::memory_order_relaxed);
+        requested.store(false, std::memory_order_relaxed);
+        return false;
+    }
+    if (!pending)
+    {
+        // the levels above were evicted or the last one came from the store, start again
+        // from the last one in memory
+        pending.reset(new AudioBuffer<float>());
+        levels[level - 1]->readAll(*pending);
+    }
+    if (pending->getNumSamples() < 2)
+    {
+        // too short to halve again, the coarsest level serves the rest of the range
+        targetLevels.store(level, std::memory_order_relaxed);
+        return buildNextLevel();
+    }
+    std::unique_ptr<AudioBuffer<float>> next(new AudioBuffer<float>());
+    decimate(*pending, *next);
+    publish(level, *next);
+    if (level + 1 < getTargetLevels())
+        pending = std::move(next);
+    else
+    {
+        pending.reset();
+        evicted.store(false, std::memory_order_relaxed);
+        requested.store(false, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void rmpSample::extendLevels(int numLevels) noexcept
+{
+    numLevels = jmin(numLevels, (int)maxLevels);
+    int current = targetLevels.load(std::memory_order_relaxed);
+    // a recording that failed to reload keeps its target of 0
+    while (current > 0 && current < numLevels
+        && !targetLevels.compare_exchange_weak(current, numLevels, std::memory_order_relaxed))
+    {
+    }
+}
+
+size_t rmpSample::evict(bool includeLevelZero)
+{
+    const int ready = getNumLevels(), standIn = getStandInLevel();
+    // level 0 only goes with a way back and a coarser level to play until then
+    const bool dropLevelZero = includeLevelZero && reloader && ready > 0 && (standIn >= 0 || ready > 1);
+    const int lowest = dropLevelZero ? 0 : 1;
+    if (ready <= lowest)
+        return 0;
+    int unpinned = 0;
+    if (!pins.compare_exchange_strong(unpinned, -1, std::memory_order_acquire, std::memory_order_relaxed))
+        return 0;
+    const int keep = (dropLevelZero && standIn < 0) ? ready - 1 : standIn;
+    if (dropLevelZero)
+        standInLevel.store(keep, std::memory_order_release);
+    readyLevels.store(lowest, std::memory_order_release);
+    size_t freed = 0;
+    for (int level = lowest; level < ready; ++level)
+    {
+        if (level == keep)
+            continue;
+        freed += levels[level]->getSizeInBytes();
+        levels[level].reset();
+    }
+    residentBytes.fetch_sub(freed, std::memory_order_relaxed);
+    pending.reset();
+    evicted.store(true, std::memory_order_relaxed);
+    pins.store(0, std::memory_order_release);
+    return freed;
+}
+
+int rmpSample::levelFor(double rate)
+{
+    int level = 0;
+    while (level < maxLevels - 1 && rate > maxLevelRate)
+    {
+        rate *= 0.5;
+        ++level;
+    }
+    return level;
+}
+
+void rmpSample::decimate(const AudioBuffer<float> &source, AudioBuffer<float> &dest)
+{
+    // Blackman windowed sinc, cut a little under the new Nyquist so the transition band
+    // mostly lies below it
+    const int numTaps = 63, centre = numTaps / 2;
+    const double cutoff = 0.225;
+    float taps[numTaps];
+    double sum = 0.0;
+    for (int n = 0; n < numTaps; ++n)
+    {
+        const double x = (double)(n - centre);
+        const double sinc = x == 0.0 ? 2.0 * cutoff : std::sin(2.0 * MathConstants<double>::pi * cutoff * x) / (MathConstants<double>::pi * x);
+        const double window = 0.42 - 0.5 * std::cos(2.0 * MathConstants<double>::pi * n / (numTaps - 1)) + 0.08 * std::cos(4.0 * MathConstants<double>::pi * n / (numTaps - 1));
+        taps[n] = (float)(sinc * window);
+        sum += taps[n];
+    }
+    for (int n = 0; n < numTaps; ++n)
+        taps[n] = (float)(taps[n] / sum);
+
+    const int numSamples = source.getNumSamples();
+    dest.setSize(source.getNumChannels(), (numSamples + 1) / 2);
+    for (int channel = 0; channel < source.getNumChannels(); ++channel)
+    {
+        const float *in = source.getReadPointer(channel);
+        float *out = dest.getWritePointer(channel);
+        for (int i = 0; i < dest.getNumSamples(); ++i)
+        {
+            const int first = 2 * i - centre;
+            float value = 0.0f;
+            for (int n = jmax(0, -first); n < numTaps && first + n < numSamples; ++n)
+                value += taps[n] * in[first + n];
+            out[i] = value;
+        }
+    }
+}
+
+// Both conversions work on the bit patterns, so they stay exact for half denormals even
+// when the audio thread runs with denormals flushed to zero.
+uint16 rmpZoneData::floatToHalf(float value) noexcept
+{
+    uint32 bits;
+    memcpy(&bits, &value, 4);
+    const uint16 sign = (uint16)((bits >> 16) & 0x8000);
+    const int exponent = (int)((bits >> 23) & 0xff);
+    uint32 mantissa = bits & 0x7fffff;
+
+    if (exponent >= 143)
+        return sign | 0x7bff;               // out of range, clamp to the largest finite half
+    if (exponent >= 113)
+    {
+        uint32 half = (uint32)(exponent - 112) << 10 | mantissa >> 13;
+        const uint32 rest = mantissa & 0x1fff;
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+            ++half;                         // a carry into the exponent is still the right value
+        return sign | (uint16)jmin(half, (uint32)0x7bff);
+    }
+    if (exponent >= 102)
+    {
+        mantissa |= 0x800000;
+        const int shift = 126 - exponent;
+        return sign | (uint16)((mantissa + (1u << (shift - 1))) >> shift);
+    }
+    return sign;
+}
+
+float rmpZoneData::halfToFloat(uint16 value) noexcept
+{
+    const uint32 sign = (uint32)(value & 0x8000) << 16;
+    const uint32 exponent = (value >> 10) & 0x1f;
+    const uint32 mantissa = value & 0x3ff;
+    if (exponent == 0)
+    {
+        const float magnitude = (float)mantissa * (1.0f / 16777216.0f);
+        return sign ? -magnitude : magnitude;
+    }
+    const uint32 bits = sign | (exponent + 112) << 23 | mantissa << 13;
+    float result;
+    memcpy(&result, &bits, 4);
+    return result;
+}
@@ -0,0 +1,354 @@
+/*
+  ==============================================================================
+
+    ZoneData.h
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "SampleArena.h"
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <vector>
+
+/** Immutable sample frames of one zone, stored planar in float or a reduced-precision format.
+
+    Reduced formats are converted back to float by the reader in short runs, so the voice
+    kernel touches half or three quarters of the memory a float zone would need.
+
+    The compressed formats quantize to 16 or 24 bits like int16/int24 and then code each
+    channel losslessly in independent blocks of blockFrames frames: a fixed polynomial
+    predictor of order 0 to 3 followed by Rice coded residuals. They can only be played
+    through an rmpZoneDecoder, which keeps the decoded blocks around.
+
+    The coding is only lossless for integer sources of 16 or 24 bits, whose frames survive
+    the quantization unchanged, and a baked loop crossfade is still rounded to the source
+    bit depth. "compressed" storage therefore keeps 32 bit and float sources as float32.
+
+    The frames are allocated from the rmpSampleArena, prefaulted and next to the zones built
+    before. A zone written with writeTo() can be read back in place from a memory mapped
+    file instead, so processes sharing an rmpSampleStore share the pages of the frames too.
+*/
+class rmpZoneData
+{
+public:
+    enum class Format : uint8 { float32, int16, int24, half, compressed16, compressed24 };
+
+    rmpZoneData(const AudioBuffer<float> &source, Format format);
+    ~rmpZoneData() = default;
+
+    /** Resolves a layer's <storage> setting, "native" keeps the bit depth of the source file
+        and "compressed" codes it losslessly where it is 16 or 24 bit integer. */
+    static Format formatFor(const String &storage, int sourceBitsPerSample);
+    static int bytesPerSample(Format format);
+
+    Format getFormat() const noexcept { return format; }
+    int getNumChannels() const noexcept { return numChannels; }
+    int getNumSamples() const noexcept { return numSamples; }
+    size_t getSizeInBytes() const noexcept { return storageBytes; }
+    bool isCompressed() const noexcept { return format == Format::compressed16 || format == Format::compressed24; }
+
+    /** Direct access for float zones, nullptr for every other format. */
+    const float *getFloatPointer(int channel, int startSample) const noexcept;
+
+    /** Converts numSamples frames of one channel to float, not available for compressed zones. */
+    void read(int channel, int startSample, int numSamples, float *dest) const noexcept;
+    /** Converts the whole zone to float, compressed ones included. Not for the audio thread. */
+    void readAll(AudioBuffer<float> &dest) const;
+
+    /** Writes the zone in the layout fromMapping() reads. The layout is the one of the machine
+        writing it, the file is only meant for processes on the same host. */
+    void writeTo(OutputStream &out) const;
+    /** A zone reading its frames straight from a file mapping, at an offset where writeTo()
+        wrote it. The offset must keep 16 byte alignment. Returns nullptr if the data there is
+        not a zone or is cut short. */
+    static std::unique_ptr<rmpZoneData> fromMapping(std::shared_ptr<const MemoryMappedFile> file, size_t offset);
+    bool isMapped() const noexcept { return mapping != nullptr; }
+
+    /** Longest run a caller should convert at once into a stack buffer. */
+    static const int readChunk = 256;
+
+    static const int blockFrames = 4096;
+    int getNumBlocks() const noexcept { return (numSamples + blockFrames - 1) / blockFrames; }
+    /** Decodes every channel of one compressed block, dest[channel] must hold blockFrames floats. */
+    void decodeBlock(int block, float *const *dest) const noexcept;
+
+    /** The highest predictor order, the frames a partition reaches back to. */
+    static const int maxOrder = 3;
+    /** Where decoding a block in steps has got to. */
+    struct BlockCursor
+    {
+        int block = -1, channel = 0, frame = 0, order = 0;
+        int history[maxOrder] = {};
+        const uint8 *bits = nullptr;
+        uint64 accumulator = 0;
+        int available = 0;
+    };
+    /** Starts decoding a block in steps with decodeBlockPart(). */
+    void beginBlock(int block, BlockCursor &cursor) const noexcept;
+    /** Decodes up to numPartitions more partitions of 256 frames of the block into dest,
+        which must stay the same for the whole block. Returns true once it is complete. */
+    bool decodeBlockPart(BlockCursor &cursor, float *const *dest, int numPartitions) const noexcept;
+
+    /** Decoding work done on this zone so far, for judging whether compression pays off. */
+    int64 getBlocksDecoded() const noexcept { return blocksDecoded.load(std::memory_order_relaxed); }
+    int64 getDecodeTicks() const noexcept { return decodeTicks.load(std::memory_order_relaxed); }
+
+private:
+    rmpZoneData() = default;
+    static uint16 floatToHalf(float value) noexcept;
+    static float halfToFloat(uint16 value) noexcept;
+    void compress(const AudioBuffer<float> &source, int bits);
+
+    Format format = Format::float32;
+    int numChannels = 0, numSamples = 0;
+    size_t channelBytes = 0, storageBytes = 0;
+    // the frames, in storage or in the mapping
+    const uint8 *bytes = nullptr;
+    rmpSampleArena::Block storage;
+    std::shared_ptr<const MemoryMappedFile> mapping;
+    // declared after the mapping, so the pages are unlocked before they are unmapped
+    rmpSampleArena::Residency residency;
+    // byte offset of each compressed block and one past the last
+    std::vector<uint32> blockOffsets;
+    mutable std::atomic<int64> blocksDecoded { 0 }, decodeTicks { 0 };
+};
+
+/** A recording with its octave mipmaps, shared by every zone that transposes it.
+
+    Level k is low-passed below its own Nyquist frequency and decimated by 2^k, so a voice
+    playing the recording k octaves up reads that level at close to its natural rate and a
+    short interpolation kernel stays free of aliasing.
+
+    Only level 0 is built with the sample, the others are filled in by rmpSampleManager after
+    the instrument is playable. getNumLevels() counts the levels published so far and readers
+    fall back to the coarsest of those until theirs arrives.
+
+    To stay within its memory budget the manager may take levels away again, the upper ones
+    first. Level 0 only goes when it can be reloaded and a coarser level was built: that
+    level stays in memory as a stand-in, which notes play until the manager has brought level
+    0 back. Voices pin the recordings they play, and a pinned recording is never evicted.
+*/
+class rmpSample
+{
+public:
+    rmpSample(const AudioBuffer<float> &levelZero, double sampleRate, int numLevels, rmpZoneData::Format format);
+    /** Starts from a level 0 that was already stored, in its format. */
+    rmpSample(std::unique_ptr<const rmpZoneData> levelZero, double sampleRate, int numLevels);
+    ~rmpSample() = default;
+
+    /** The level to read for a playback rate relative to the recording. A level is read at up
+        to maxLevelRate times its own rate, trading some fold-back at the very top of the band
+        for keeping the full band on small upward transpositions. */
+    static int levelFor(double rate);
+
+    int getNumLevels() const noexcept { return readyLevels.load(std::memory_order_acquire); }
+    int getTargetLevels() const noexcept { return targetLevels.load(std::memory_order_relaxed); }
+    bool isComplete() const noexcept { return getNumLevels() >= getTargetLevels(); }
+    const rmpZoneData &getLevel(int level) const noexcept { return *levels[level]; }
+    /** The coarse level kept while level 0 is evicted, -1 when level 0 is in memory. */
+    int getStandInLevel() const noexcept { return standInLevel.load(std::memory_order_acquire); }
+    /** The level a pinned reader reads for the one it wants: the nearest ready level below
+        it, or the stand-in while level 0 is reloaded. */
+    int levelToRead(int wanted) const noexcept;
+
+    /** Moves the recording to the front of the build queue, safe to call from the audio thread. */
+    void request() const noexcept { requested.store(true, std::memory_order_relaxed); }
+    bool isRequested() const noexcept { return requested.load(std::memory_order_relaxed); }
+
+    /** Keeps the levels in memory until unpin(), safe to call from the audio thread. Fails
+        while the manager is evicting the recording, or when it has nothing to read. */
+    bool pin() const noexcept;
+    void unpin() const noexcept { pins.fetch_sub(1, std::memory_order_release); }
+    /** Millisecond counter of the last pin, the manager evicts the oldest recordings first. */
+    uint32 getLastUsed() const noexcept { return lastUsed.load(std::memory_order_relaxed); }
+
+    /** Fills a buffer with level 0 again after it was evicted, returns false on failure. */
+    typedef std::function<bool(AudioBuffer<float> &)> Reloader;
+    void setReloader(Reloader newReloader) { reloader = std::move(newReloader); }
+
+    /** Name under which the recording is shared, within the process and through the
+        rmpSampleStore; empty for a recording that is not shared. Set before it is shared. */
+    void setKey(const String &newKey) { key = newKey; }
+    const String &getKey() const noexcept { return key; }
+    /** The pack the recording was decoded from, a stored level is only used while it is unchanged. */
+    void setPack(const File &file) { pack = file; }
+    const File &getPack() const noexcept { return pack; }
+    /** First frame of the source file kept in level 0, the head before it was trimmed. */
+    void setSourceStart(int frame) noexcept { sourceStart = frame; }
+    int getSourceStart() const noexcept { return sourceStart; }
+
+    /** Raises the number of levels to build, for an instrument sharing the recording over a
+        wider range. The manager builds the new levels in the background. */
+    void extendLevels(int numLevels) noexcept;
+
+    /** Builds and publishes the next missing level, reloading level 0 first if it was
+        evicted. Returns false when none is left. Only the manager thread calls this. */
+    bool buildNextLevel();
+    /** Publishes a level read from elsewhere instead of building it, returns false if it is
+        not the next missing level or does not match the recording. Manager thread only. */
+    bool adoptLevel(int level, std::unique_ptr<const rmpZoneData> data);
+    /** Frees the levels above 0, and with includeLevelZero also level 0 and the levels
+        below the coarsest, which stays as the stand-in. Level 0 only goes when the recording
+        can be reloaded and has a coarser level. Does nothing while the recording is pinned,
+        returns the number of bytes freed. Only the manager thread calls this. */
+    size_t evict(bool includeLevelZero);
+    /** Set once levels were evicted, the manager only rebuilds them on request(). */
+    bool isEvicted() const noexcept { return evicted.load(std::memory_order_relaxed); }
+
+    int getNumSamples() const noexcept { return numSamples; }
+    int getNumChannels() const noexcept { return numChannels; }
+    /** The native rate of the recording, which level 0 is stored at. */
+    double getSampleRate() const noexcept { return sampleRate; }
+    /** Bytes held by the levels currently in memory. */
+    size_t getSizeInBytes() const noexcept { return residentBytes.load(std::memory_order_relaxed); }
+
+    static const int maxLevels = 8;
+    static constexpr double maxLevelRate = 1.5;
+
+private:
+    /** Halves the rate of a buffer behind a windowed-sinc low-pass. */
+    static void decimate(const AudioBuffer<float> &source, AudioBuffer<float> &dest);
+
+    /** Publishes a level and accounts for its memory. */
+    void publish(int level, const AudioBuffer<float> &data);
+    void publish(int level, std::unique_ptr<const rmpZoneData> data);
+
+    std::unique_ptr<const rmpZoneData> levels[maxLevels];
+    std::atomic<int> readyLevels { 0 };
+    std::atomic<int> standInLevel { -1 };
+    // lowered by the manager when a level cannot be built
+    std::atomic<int> targetLevels;
+    int numSamples, numChannels, sourceStart = 0;
+    rmpZoneData::Format format;
+    double sampleRate;
+    // float copy of the last level built, kept until the remaining levels are made from it
+    std::unique_ptr<AudioBuffer<float>> pending;
+    Reloader reloader;
+    String key;
+    File pack;
+    std::atomic<size_t> residentBytes { 0 };
+    std::atomic<bool> evicted { false };
+    mutable std::atomic<bool> requested { false };
+    // number of voices playing the recording, -1 while the manager evicts it
+    mutable std::atomic<int> pins { 0 };
+    mutable std::atomic<uint32> lastUsed;
+};
+
+/** Decoded blocks of a compressed zone, owned by the voice that plays it.
+
+    The ring holds the last blocks that were played, so a loop spanning a block boundary or a
+    ping-pong turn decodes each block once instead of on every pass. The block the playback
+    reaches next is decoded ahead a few partitions per read, so voices started together do
+    not all decode a whole block in the callback where they cross into it.
+*/
+class rmpZoneDecoder
+{
+public:
+    rmpZoneDecoder() = default;
+    ~rmpZoneDecoder() = default;
+
+    /** Allocates the ring, called while building so the audio thread never allocates. */
+    void allocate(int maxChannels)
+    {
+        blocks.setSize(numSlots * maxChannels, rmpZoneData::blockFrames);
+        channelsPerSlot = maxChannels;
+        reset();
+    }
+    bool isAllocated() const noexcept { return channelsPerSlot > 0; }
+
+    void reset() noexcept
+    {
+        for (int slot = 0; slot < numSlots; ++slot)
+            slotData[slot] = nullptr;
+        aheadSlot = -1;
+        lastData = nullptr;
+    }
+
+    /** Copies numSamples frames of one channel to dest, decoding blocks as they are reached. */
+    void read(const rmpZoneData &data, int channel, int startSample, int numSamples, float *dest) noexcept
+    {
+        jassert(isAllocated() && data.getNumChannels() <= channelsPerSlot);
+        // a ping-pong loop on its way back reads lower frames each time
+        const bool backwards = lastData == &data && startSample < lastStart;
+        lastData = &data;
+        lastStart = startSample;
+        int block = 0;
+        while (numSamples > 0)
+        {
+            block = startSample / rmpZoneData::blockFrames;
+            const int offset = startSample - block * rmpZoneData::blockFrames;
+            const int count = jmin(numSamples, rmpZoneData::blockFrames - offset);
+            const int slot = decodedSlot(data, block);
+            memcpy(dest, blocks.getReadPointer(slot * channelsPerSlot + channel, offset), (size_t)count * sizeof(float));
+            dest += count;
+            startSample += count;
+            numSamples -= count;
+        }
+        // a read covers at most readChunk frames of one channel, so two partitions per channel
+        // and read finish the next block within the first half of this one
+        const int next = block + (backwards ? -1 : 1);
+        if (isPositiveAndBelow(next, data.getNumBlocks()))
+            decodeAhead(data, next, 2 * data.getNumChannels());
+    }
+
+private:
+    float *const *slotChannels(int slot) noexcept { return blocks.getArrayOfWritePointers() + slot * channelsPerSlot; }
+
+    /** The slot holding the whole block, finishing it if it was being decoded ahead. */
+    int decodedSlot(const rmpZoneData &data, int block) noexcept
+    {
+        // neighbouring blocks fall in different slots
+        const int slot = block % numSlots;
+        if (slotData[slot] == &data && slotBlock[slot] == block)
+        {
+            if (aheadSlot == slot)
+            {
+                data.decodeBlockPart(ahead, slotChannels(slot), std::numeric_limits<int>::max());
+                aheadSlot = -1;
+            }
+            return slot;
+        }
+        if (aheadSlot == slot)
+            aheadSlot = -1;
+        data.decodeBlock(block, slotChannels(slot));
+        slotData[slot] = &data;
+        slotBlock[slot] = block;
+        return slot;
+    }
+
+    /** Decodes a few more partitions of a block that is about to be played. */
+    void decodeAhead(const rmpZoneData &data, int block, int numPartitions) noexcept
+    {
+        const int slot = block % numSlots;
+        if (slotData[slot] != &data || slotBlock[slot] != block)
+        {
+            // a block left half decoded is no use to anyone
+            if (aheadSlot >= 0)
+                slotData[aheadSlot] = nullptr;
+            data.beginBlock(block, ahead);
+            slotData[slot] = &data;
+            slotBlock[slot] = block;
+            aheadSlot = slot;
+        }
+        if (aheadSlot == slot && data.decodeBlockPart(ahead, slotChannels(slot), numPartitions))
+            aheadSlot = -1;
+    }
+
+    static const int numSlots = 3;
+    AudioBuffer<float> blocks;
+    const rmpZoneData *slotData[numSlots] = {};
+    int slotBlock[numSlots] = {};
+    int channelsPerSlot = 0;
+    // the block being decoded ahead, -1 when there is none
+    int aheadSlot = -1;
+    rmpZoneData::BlockCursor ahead;
+    // where the last read started, for telling which way the playback goes
+    const rmpZoneData *lastData = nullptr;
+    int lastStart = 0;
+};
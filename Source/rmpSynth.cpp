@@ -1,77 +1,315 @@
 
 #include "rmpSynth.h"
-#include "PitchShifter.h"
+#include "SQLInputSource.h"
 #include <math.h>
 #include <stdlib.h>
   
 
-void LayerSound::appendBox(soundBox &tempBox, float hostSampleRate) {
+bool LayerSound::findForwardLoop(const soundBox &tempBox, int trimStart, int length, int &loopStart, int &loopEnd) {
+    // a ping-pong loop turns around instead of jumping, so only a forward loop has a seam to hide
+    if (tempBox.loopMode != "forward")
+        return false;
+    loopStart = jlimit(0, length, tempBox.loopStart - trimStart);
+    loopEnd = jlimit(0, length, tempBox.loopEnd - trimStart);
+    return loopEnd - loopStart >= 2;
+}
 
-    WavAudioFormat wav_decoder;
-    MemoryInputStream *input_stream = new MemoryInputStream((const void *)tempBox.soundfile_data, tempBox.soundfile_size, true);
-    AudioFormatReader *source = wav_decoder.createReaderFor(input_stream, false);
+std::shared_ptr<rmpSample> LayerSound::loadSample(const soundBox &tempBox, const String &key, float hostSampleRate) {
 
-    std::shared_ptr< AudioBuffer<float> > temp_pointer;
+    rmpSampleStore &store = sampleManager->getStore();
+    const File packFile(tempBox.database);
+    std::shared_ptr<rmpSample> sample;
+    rmpSampleStore::Level stored = store.attach(key, packFile, 0);
+    if (stored.data) {
+        // another process decoded the recording already, its level 0 is read where it lies
+        const double highestRate = std::pow(2.0, (tempBox.highestNote - tempBox.mainNote) / 12.0) * stored.sampleRate / hostSampleRate;
+        sample = std::make_shared<rmpSample>(std::move(stored.data), stored.sampleRate, rmpSample::levelFor(highestRate) + 2);
+        sample->setSourceStart(stored.sourceStart);
+    }
+    else {
+        SQLInputSource pack("", tempBox.database);
+        WavAudioFormat wav_decoder;
+        std::unique_ptr<AudioFormatReader> source(wav_decoder.createReaderFor(pack.createInputStreamFor(tempBox.soundfile), true));
+        if (!source)
+            return nullptr;
 
-    double ratio = source->sampleRate / hostSampleRate;
+        // mono recordings stay mono, the voice spreads them to stereo when mixing
+        const int numChannels = jlimit(1, 2, (int)source->numChannels);
+        const rmpZoneData::Format format = rmpZoneData::formatFor(storage, (int)source->bitsPerSample);
+        AudioBuffer<float> decoded(numChannels, (int)source->lengthInSamples);
+        source->read(&decoded, 0, (int)source->lengthInSamples, 0, true, numChannels > 1);
 
-    AudioBuffer<float> base(2, (int)source->lengthInSamples);
-    source->read(&base, 0, (int)source->lengthInSamples, 0, true, true);
+        // silence at the head and tail is never stored
+        int trimStart = 0, trimEnd = decoded.getNumSamples();
+        if (trimThreshold > 0.0f) {
+            findAudibleRange(decoded, trimThreshold, trimStart, trimEnd);
+            if (tempBox.loopMode.isNotEmpty() && tempBox.loopEnd > tempBox.loopStart) {
+                trimStart = jmin(trimStart, jmax(0, tempBox.loopStart));
+                trimEnd = jmax(trimEnd, jmin(decoded.getNumSamples(), tempBox.loopEnd));
+            }
+        }
+        // the recording keeps its native rate, the voice folds the host rate into its playback rate
+        const int length = trimEnd - trimStart;
+        AudioBuffer<float> levelZero(decoded.getArrayOfWritePointers(), numChannels, trimStart, length);
+        int loopStart, loopEnd;
+        if (findForwardLoop(tempBox, trimStart, length, loopStart, loopEnd))
+            bakeLoopCrossfade(levelZero, loopStart, loopEnd, tempBox.loopCrossfade);
 
-    int length = (int)(((float)base.getNumSamples()) / ratio);
-    temp_pointer.reset(new AudioBuffer<float>(2, length));
-    resample(base, *temp_pointer, (float)ratio);
+        // one recording serves the whole key range, the highest note reads the coarsest level;
+        // a spare level keeps it band-limited if the host rate later drops by up to half
+        const double highestRate = std::pow(2.0, (tempBox.highestNote - tempBox.mainNote) / 12.0) * source->sampleRate / hostSampleRate;
+        // only level 0 is built here, the manager adds the others once the instrument plays
+        sample = std::make_shared<rmpSample>(levelZero, source->sampleRate, rmpSample::levelFor(highestRate) + 2, format);
+        sample->setSourceStart(trimStart);
+        store.publish(key, packFile, 0, sample->getLevel(0), source->sampleRate, trimStart);
+    }
+    sample->setPack(packFile);
+
+    // an evicted level 0 is decoded again from the pack exactly as it was built here
+    const String database = tempBox.database, soundfile = tempBox.soundfile;
+    const int trimStart = sample->getSourceStart(), length = sample->getNumSamples(), numChannels = sample->getNumChannels();
+    int loopStart = 0, loopEnd = 0;
+    if (!findForwardLoop(tempBox, trimStart, length, loopStart, loopEnd))
+        loopStart = loopEnd = 0;
+    const int loopCrossfade = tempBox.loopCrossfade;
+    sample->setReloader([=](AudioBuffer<float> &dest) {
+        SQLInputSource pack("", database);
+        WavAudioFormat wav;
+        std::unique_ptr<AudioFormatReader> reader(wav.createReaderFor(pack.createInputStreamFor(soundfile), true));
+        if (!reader || (int)reader->lengthInSamples < trimStart + length)
+            return false;
+        dest.setSize(numChannels, length);
+        reader->read(&dest, 0, length, trimStart, true, numChannels > 1);
+        if (loopEnd > loopStart)
+            bakeLoopCrossfade(dest, loopStart, loopEnd, loopCrossfade);
+        return true;
+    });
+    return sample;
+}
 
-    PitchShifter pitch_shifter;
+Result LayerSound::appendBox(soundBox &tempBox, float hostSampleRate) {
+
+    // everything the stored frames depend on, so instruments loaded from the same pack with
+    // the same settings share one copy of the recording; a pack rewritten in place is a new pack
+    const File pack(tempBox.database);
+    const String key = tempBox.database + "|" + String(pack.getSize()) + "|" + String(pack.getLastModificationTime().toMilliseconds())
+        + "|" + tempBox.soundfile + "|" + storage + "|" + String(trimThreshold)
+        + "|" + tempBox.loopMode + "|" + String(tempBox.loopStart) + "|" + String(tempBox.loopEnd) + "|" + String(tempBox.loopCrossfade);
+    std::shared_ptr<rmpSample> sample = sampleManager->find(key);
+    if (!sample) {
+        sample = loadSample(tempBox, key, hostSampleRate);
+        if (!sample)
+            return Result::fail(tempBox.soundfile + " is missing from the pack or is not a WAV file");
+        // another instance may have loaded the same recording meanwhile, the first one is kept
+        sample = sampleManager->add(sample, key);
+        if (!sample)
+            return Result::fail(tempBox.soundfile + " does not fit in the sample memory budget of "
+                + String(sampleManager->getBudget() / 1048576) + " MB");
+    }
+    // a shared recording may have been loaded for a narrower key range or a higher host rate
+    const double highestRate = std::pow(2.0, (tempBox.highestNote - tempBox.mainNote) / 12.0) * sample->getSampleRate() / hostSampleRate;
+    sample->extendLevels(rmpSample::levelFor(highestRate) + 2);
+
+    const int trimStart = sample->getSourceStart(), length = sample->getNumSamples();
+
+    // what every note of the box shares, all positions in frames of level 0
+    rmpZone boxTemplate;
+    boxTemplate.lowestVel = tempBox.lowestVel;
+    boxTemplate.highestVel = tempBox.highestVel;
+    // balance law: the centre keeps both channels at unity, as the duplicated mono data used to
+    const float pan = jlimit(-1.0f, 1.0f, tempBox.pan);
+    boxTemplate.channelGains[0] = pan > 0.0f ? 1.0f - pan : 1.0f;
+    boxTemplate.channelGains[1] = pan < 0.0f ? 1.0f + pan : 1.0f;
+    if (tempBox.loopMode == "forward" || tempBox.loopMode == "pingpong") {
+        boxTemplate.loopStart = jlimit(0, length, tempBox.loopStart - trimStart);
+        boxTemplate.loopEnd = jlimit(0, length, tempBox.loopEnd - trimStart);
+        if (boxTemplate.loopEnd - boxTemplate.loopStart >= 2)
+            boxTemplate.loop = (tempBox.loopMode == "forward") ? rmpZone::Loop::forward : rmpZone::Loop::pingPong;
+    }
+    boxTemplate.startDelay = trimStart;
+    boxTemplate.sample = sample;
 
     for (int stepNote = tempBox.lowestNote; stepNote <= tempBox.highestNote; ++stepNote) {
-        std::shared_ptr< AudioBuffer<float> > transposed = pitch_shifter.transposeBuffer(temp_pointer, stepNote - tempBox.mainNote);
-        std::shared_ptr< AudioBuffer<float> > prev = 0;
+        rmpZone zone = boxTemplate;
+        zone.lowestNote = zone.highestNote = (uint8)stepNote;
+        zone.rate = std::pow(2.0, (stepNote - tempBox.mainNote) / 12.0);
+        const uint16 boxZone = addZone(zone);
+        // cells already covered by other boxes play them together with this one at runtime
+        std::map<uint16, uint16> extendedSets;
         for (int stepVel = tempBox.lowestVel; stepVel <= tempBox.highestVel; ++stepVel) {
-            if (!fullData[stepNote][stepVel]) {
-                fullData[stepNote][stepVel] = transposed;
-                prev = 0;
+            coverage.set(coverageIndex(stepNote, stepVel));
+            uint16 &cell = zoneMap[stepNote][stepVel];
+            auto extended = extendedSets.find(cell);
+            if (extended == extendedSets.end()) {
+                rmpZoneSet set = {};
+                if (cell)
+                    set = zoneSets[cell - 1];
+                // the layer is thrown away with the instrument, nothing to undo
+                if (set.numZones >= rmpZoneSet::maxZones)
+                    return Result::fail(tempBox.soundfile + " overlaps " + String(set.numZones) + " other boxes on note "
+                        + String(stepNote) + " at velocity " + String(stepVel) + ", a cell plays at most "
+                        + String(rmpZoneSet::maxZones));
+                set.zones[set.numZones++] = boxZone;
+                zoneSets.push_back(set);
+                jassert(zoneSets.size() < 0xffff);
+                extended = extendedSets.emplace(cell, (uint16)zoneSets.size()).first;
             }
-            else {
-                if (prev == fullData[stepNote][stepVel]) {
-                    continue;
-                }
-                prev = fullData[stepNote][stepVel];
-                if (fullData[stepNote][stepVel]->getNumSamples() < transposed->getNumSamples()) {
-                    fullData[stepNote][stepVel]->setSize(fullData[stepNote][stepVel]->getNumChannels(),
-                        transposed->getNumSamples(), true, true);
-                }
-
-                fullData[stepNote][stepVel]->addFrom(0, 0, *transposed, 0, 0, transposed->getNumSamples());
-                fullData[stepNote][stepVel]->addFrom(1, 0, *transposed, 1, 0, transposed->getNumSamples());
+            cell = extended->second;
+        }
+    }
 
-            }
+    // sets replaced by an extended one above are no longer referenced
+    std::vector<uint16> remap(zoneSets.size() + 1, 0);
+    for (int note = 0; note < 128; ++note)
+        for (int vel = 0; vel < 128; ++vel)
+            if (zoneMap[note][vel])
+                remap[zoneMap[note][vel]] = 1;
+    std::vector<rmpZoneSet> kept;
+    for (size_t index = 0; index < zoneSets.size(); ++index)
+        if (remap[index + 1]) {
+            kept.push_back(zoneSets[index]);
+            remap[index + 1] = (uint16)kept.size();
         }
+    zoneSets.swap(kept);
+    for (int note = 0; note < 128; ++note)
+        for (int vel = 0; vel < 128; ++vel)
+            zoneMap[note][vel] = remap[zoneMap[note][vel]];
+    return Result::ok();
+}
+
+uint16 LayerSound::addZone(const rmpZone &zone) {
+    zones.push_back(zone);
+    jassert(zones.size() < 0xffff);
+    return (uint16)(zones.size() - 1);
+}
+
+void LayerSound::findAudibleRange(const AudioBuffer<float> &data, float threshold, int &start, int &end) {
+    auto isAudible = [&data, threshold](int frame) {
+        for (int channel = 0; channel < data.getNumChannels(); ++channel)
+            if (std::abs(data.getSample(channel, frame)) >= threshold)
+                return true;
+        return false;
+    };
+    start = 0;
+    end = data.getNumSamples();
+    while (start < end && !isAudible(start))
+        ++start;
+    while (end > start && !isAudible(end - 1))
+        --end;
+    if (start == end) {
+        // a silent recording keeps a single frame rather than none
+        start = 0;
+        end = jmin(1, data.getNumSamples());
     }
-    delete source;
 }
 
-void LayerSound::resample(AudioBuffer<float> &base, AudioBuffer<float> &resampled, float ratio) {
-    ScopedPointer<LagrangeInterpolator> resampler = new LagrangeInterpolator();
-    
-    const float **inputs  = base.getArrayOfReadPointers();
-    float **outputs = resampled.getArrayOfWritePointers();
-    for (int c = 0; c < resampled.getNumChannels(); c++)
-    {
-	    resampler->reset();
-	    resampler->process(ratio, inputs[c], outputs[c], resampled.getNumSamples());
+void LayerSound::bakeLoopCrossfade(AudioBuffer<float> &data, int loopStart, int loopEnd, int crossfadeLength) {
+    // the end of the loop fades into the audio leading up to its start, so the jump back is seamless
+    crossfadeLength = jmin(crossfadeLength, loopStart, loopEnd - loopStart);
+    if (crossfadeLength <= 0)
+        return;
+    const int fadeStart = loopEnd - crossfadeLength;
+    const int sourceStart = loopStart - crossfadeLength;
+    for (int channel = 0; channel < data.getNumChannels(); ++channel) {
+        float *samples = data.getWritePointer(channel);
+        for (int i = 0; i < crossfadeLength; ++i) {
+            const float fade = (float)(i + 1) / (float)(crossfadeLength + 1);
+            samples[fadeStart + i] = samples[fadeStart + i] * (1.0f - fade) + samples[sourceStart + i] * fade;
+        }
     }
 }
-    
+
+int LayerSound::getZones(int midiNoteNumber, float velocity, const rmpZone **zonesOut, float *gainsOut) const {
+    const int velocityCell = velocityIndex(velocity);
+    const uint16 index = zoneMap[midiNoteNumber][velocityCell];
+    if (!index)
+        return 0;
+    const rmpZoneSet &set = zoneSets[index - 1];
+    for (int i = 0; i < set.numZones; ++i) {
+        zonesOut[i] = &zones[set.zones[i]];
+        gainsOut[i] = crossfadeGain(*zonesOut[i], set, velocityCell);
+    }
+    return set.numZones;
+}
+
+float LayerSound::crossfadeGain(const rmpZone &zone, const rmpZoneSet &set, int velocityCell) const {
+    if (crossfade == Crossfade::sum)
+        return 1.0f;
+
+    // a zone fades in across the part of its range it shares with a zone reaching lower,
+    // and fades out across the part it shares with a zone reaching higher
+    float gain = 1.0f;
+    for (int i = 0; i < set.numZones; ++i) {
+        const rmpZone &other = zones[set.zones[i]];
+        float position = -1.0f;
+        if (other.lowestVel < zone.lowestVel) {
+            const int overlapEnd = jmin(other.highestVel, zone.highestVel);
+            position = (velocityCell - zone.lowestVel + 0.5f) / (overlapEnd - zone.lowestVel + 1);
+        }
+        else if (other.highestVel > zone.highestVel) {
+            const int overlapStart = jmax(other.lowestVel, zone.lowestVel);
+            position = 1.0f - (velocityCell - overlapStart + 0.5f) / (zone.highestVel - overlapStart + 1);
+        }
+        if (position < 0.0f)
+            continue;
+        position = jlimit(0.0f, 1.0f, position);
+        gain *= (crossfade == Crossfade::linear) ? position : std::sin(position * MathConstants<float>::halfPi);
+    }
+    return gain;
+}
+
+String LayerSound::describeStorage() const {
+    size_t storedBytes = 0, floatBytes = 0;
+    int64 blocksDecoded = 0, decodeTicks = 0;
+    // the zones of a box share one recording
+    std::unordered_set<const rmpSample *> counted;
+    for (auto zone = zones.begin(); zone != zones.end(); ++zone) {
+        if (!counted.insert(zone->sample.get()).second)
+            continue;
+        // the manager may evict levels meanwhile, pinning keeps them while they are looked at
+        if (!zone->sample->pin())
+            continue;
+        // an evicted level 0 leaves a stand-in above the levels published again
+        const int standIn = zone->sample->getStandInLevel(), ready = zone->sample->getNumLevels();
+        for (int level = 0; level < jmax(ready, standIn + 1); ++level) {
+            if (level >= ready && level != standIn)
+                continue;
+            const rmpZoneData &data = zone->sample->getLevel(level);
+            storedBytes += data.getSizeInBytes();
+            floatBytes += (size_t)data.getNumChannels() * (size_t)data.getNumSamples() * sizeof(float);
+            blocksDecoded += data.getBlocksDecoded();
+            decodeTicks += data.getDecodeTicks();
+        }
+        zone->sample->unpin();
+    }
+    String report = name + ": " + String(getNumZones()) + " zones as " + storage + ", "
+        + String((double)storedBytes / 1048576.0, 1) + " MB (" + String((double)floatBytes / 1048576.0, 1) + " MB as float)";
+    if (blocksDecoded > 0) {
+        const double seconds = Time::highResolutionTicksToSeconds(decodeTicks);
+        report << ", " << String(blocksDecoded) << " blocks decoded at "
+            << String(seconds * 1.0e9 / ((double)blocksDecoded * rmpZoneData::blockFrames), 1) << " ns per frame";
+    }
+    return report;
+}
+
+size_t LayerSound::getSampleBytes(std::unordered_set<const rmpSample *> &counted) const
+{
+    size_t bytes = 0;
+    for (auto zone = zones.begin(); zone != zones.end(); ++zone)
+        if (counted.insert(zone->sample.get()).second)
+            bytes += zone->sample->getSizeInBytes();
+    return bytes;
+}
+
 bool LayerSound::appliesToNote(int midiNoteNumber) {
     for (int vel = 0 ; vel < 128; ++vel)
-        if (getDataLength(midiNoteNumber, ((float)vel)/128))
+        if (coverage[coverageIndex(midiNoteNumber, vel)])
             return true;
     return false;
     }
     
 bool LayerSound::appliesToNoteAndVelocity(int midiNoteNumber, float velocity) {
-    return (getDataLength(midiNoteNumber, velocity)) ? true : false;
+    return coverage[coverageIndex(midiNoteNumber, velocityIndex(velocity))];
     }
     
 bool LayerSound::appliesToChannel(int) {
@@ -80,64 +318,276 @@ bool LayerSound::appliesToChannel(int) {
 void LayerSound::clear() {
 	for (int note = 0; note < 128; ++note)
 		for (int vel = 0; vel < 128; ++vel) {
-			fullData[note][vel] = 0;
+			zoneMap[note][vel] = 0;
 			}
+    zones.clear();
+    zoneSets.clear();
+    coverage.reset();
 }
 
 void LayerVoice::noteOn(int midiChannel, int midiNoteNumber, float velocity)
 {
+    releaseZones();
+    const int numFound = dynamic_cast<LayerSound&>(sound).getZones(midiNoteNumber, velocity, zones, zoneGains);
+    // a recording the manager is evicting just then is pinned again when it is mixed
+    for (int z = 0; z < numFound; ++z)
+        zonePinned[z] = zones[z]->sample->pin();
+    numZones = numFound;
+    if (!numZones)
+        return;
+    startDelay = 0;
+    for (int z = 0; z < numZones; ++z)
+    {
+        zonePositions[z] = -(double)zones[z]->startDelay;
+        zoneReversed[z] = false;
+        decoders[z].reset();
+        startDelay = jmax(startDelay, (int)std::ceil(zones[z]->startDelay / (zones[z]->rate * zones[z]->sample->getSampleRate() / currentSampleRate)));
+    }
     currentPlayingMidiChannel = midiChannel;
     currentlyPlayingNote = midiNoteNumber;
     currentlyPlayingVelocity = velocity;
     currentSamplePosition = 0;
-    sendToListenersAboutStart();
+    vibratoPhase = 0.0;
+    lifecycle.post(rmpVoiceLifecycle::Event::noteOn);
+    if (envelope)
+        envelope->start();
+    else
+        lifecycle.post(rmpVoiceLifecycle::Event::attackFinished);
+    lifecycle.pollChange();
 }
 
 void LayerVoice::noteOff(bool forced)
 {
-    if (askListenersForRelease() || forced) 
+    if (!isVoiceActive())
+        return;
+    if (!forced && envelope && envelope->release())
     {
-        currentPlayingMidiChannel = 0;
-        currentlyPlayingNote = -1;
-        currentlyPlayingVelocity = 0;
-        currentSamplePosition = 0;
+        // the envelope posts "finished" once the release has run out
+        lifecycle.post(rmpVoiceLifecycle::Event::noteOff);
+        lifecycle.pollChange();
+        return;
     }
+    if (envelope)
+        envelope->kill();
+    finish();
 };
 
+void LayerVoice::releaseZones()
+{
+    for (int z = 0; z < numZones; ++z)
+        if (zonePinned[z])
+            zones[z]->sample->unpin();
+    numZones = 0;
+}
+
+void LayerVoice::finish()
+{
+    releaseZones();
+    clearNote();
+    if (owner)
+        owner->layerFinished();
+}
+
 void LayerVoice::renderNextBlock(AudioBuffer<float>& outputBuffer, int startSample, int numSamples) 
 {
-    if (isVoiceActive())
+    while (isVoiceActive() && numSamples > 0)
     {
-        LayerSound &s = dynamic_cast<LayerSound&>(sound);
-        AudioBuffer<float> *pure_data = s.getData(currentlyPlayingNote, currentlyPlayingVelocity).get();
+        const int chunk = jmin(numSamples, aftereffect.getNumSamples());
 
-        int datasize = s.getDataLength(currentlyPlayingNote, currentlyPlayingVelocity);
-        int samplesToCopy = ((numSamples + currentSamplePosition) > datasize) ? datasize - currentSamplePosition : numSamples;
-
-        if (samplesToCopy <= 0)
-            this->noteOff(false);
+        // all zones of the cell are mixed with their crossfade gains straight into the voice buffer
+        aftereffect.clear(0, chunk);
+        bool samplesLeft = false;
+        for (int done = 0; done < chunk;)
+        {
+            // a steady pitch keeps one rate for the chunk, a moving one is updated every few frames
+            const bool modulated = vibratoDepth > 0.0f || pitch.isSmoothing();
+            const int frames = modulated ? jmin(chunk - done, (int)modulationInterval) : chunk - done;
+            float semitones = pitch.getCurrentValue();
+            pitch.skip(frames);
+            if (vibratoDepth > 0.0f)
+            {
+                semitones += vibratoDepth * (float)std::sin(vibratoPhase);
+                vibratoPhase = std::fmod(vibratoPhase + vibratoIncrement * frames, MathConstants<double>::twoPi);
+            }
+            const double rateScale = semitones == 0.0f ? 1.0 : std::exp2(semitones / 12.0);
+            for (int z = 0; z < numZones; ++z)
+                if (mixZone(z, done, frames, rateScale) > 0)
+                    samplesLeft = true;
+            done += frames;
+        }
+        if (!samplesLeft)
+        {
+            noteOff(true);
+            return;
+        }
 
-        aftereffect.copyFrom(0, 0, *pure_data, 0, currentSamplePosition, samplesToCopy);
-        aftereffect.copyFrom(1, 0, *pure_data, 1, currentSamplePosition, samplesToCopy);
-        rack->applyOn(aftereffect, 0, samplesToCopy);
+        rack->applyOn(aftereffect, 0, chunk);
+        if (envelope && currentSamplePosition >= startDelay)
+            envelope->cullIfInaudible(aftereffect.getMagnitude(0, chunk));
 
         if (aftereffect.getNumChannels() > 1 && outputBuffer.getNumChannels() > 1)
         {
-            outputBuffer.addFrom(0, startSample, aftereffect, 0, 0, samplesToCopy);
-            outputBuffer.addFrom(1, startSample, aftereffect, 1, 0, samplesToCopy);
+            outputBuffer.addFrom(0, startSample, aftereffect, 0, 0, chunk);
+            outputBuffer.addFrom(1, startSample, aftereffect, 1, 0, chunk);
         }
         else if (aftereffect.getNumChannels() == 1)
         {
-            outputBuffer.addFrom(0, startSample, aftereffect, 0, 0, samplesToCopy);
-            outputBuffer.addFrom(1, startSample, aftereffect, 0, 0, samplesToCopy);
+            outputBuffer.addFrom(0, startSample, aftereffect, 0, 0, chunk);
+            outputBuffer.addFrom(1, startSample, aftereffect, 0, 0, chunk);
         }
         else if (outputBuffer.getNumChannels() == 1)
         {
-            aftereffect.applyGain(0, 0, samplesToCopy, 0.5);
-            outputBuffer.addFrom(0, startSample, aftereffect, 0, 0, samplesToCopy);
-            outputBuffer.addFrom(0, startSample, aftereffect, 1, 0, samplesToCopy, 0.5);
+            aftereffect.applyGain(0, 0, chunk, 0.5);
+            outputBuffer.addFrom(0, startSample, aftereffect, 0, 0, chunk);
+            outputBuffer.addFrom(0, startSample, aftereffect, 1, 0, chunk, 0.5);
         }
-        currentSamplePosition += samplesToCopy;
+        currentSamplePosition += chunk;
+        startSample += chunk;
+        numSamples -= chunk;
+
+        if (lifecycle.pollChange() && lifecycle.isDone())
+            finish();
+    }
+}
+
+int LayerVoice::mixZone(int z, int destStart, int numFrames, double rateScale)
+{
+    const rmpZone &zone = *zones[z];
+    double &position = zonePositions[z];
+    const double step = zone.rate * rateScale * zone.sample->getSampleRate() / currentSampleRate;
+    // the mipmap level follows bends, as far as the levels built for the box reach; until a level
+    // is built the nearest finer one stands in and its recording is moved up the queue
+    const int wantedLevel = rmpSample::levelFor(step);
+    // without a pin any level may go at any time, the zone waits until it gets one
+    if (!zonePinned[z] && !(zonePinned[z] = zone.sample->pin()))
+        return numFrames;
+    // an evicted level 0 is asked for too, the stand-in plays until it is back
+    const int readyLevels = zone.sample->getNumLevels();
+    if (wantedLevel >= readyLevels && readyLevels < zone.sample->getTargetLevels())
+        zone.sample->request();
+    const int level = zone.sample->levelToRead(wantedLevel);
+    // the longest run whose interpolation window still fits the reader's stack buffer
+    const int maxRun = jmax(1, (int)((rmpZoneData::readChunk - 4) / (step / (double)(1 << level))));
+    int done = 0;
+    if (position < 0.0)
+    {
+        // the trimmed head of the recording, nothing to mix yet
+        done = jmin(numFrames, (int)std::ceil(-position / step));
+        position += done * step;
+    }
+
+    while (done < numFrames)
+    {
+        const bool reversed = zoneReversed[z];
+        const bool looping = zone.loop != rmpZone::Loop::none && (reversed || position < zone.loopEnd);
+        // a ping-pong loop turns on its last frame so that frame is not played twice
+        double boundary = (double)zone.sample->getNumSamples();
+        if (reversed)
+            boundary = (double)zone.loopStart;
+        else if (looping)
+            boundary = (double)(zone.loop == rmpZone::Loop::pingPong ? zone.loopEnd - 1 : zone.loopEnd);
+        const double distance = reversed ? position - boundary : boundary - position;
+        if (distance <= 0.0)
+        {
+            if (!looping)
+                break;
+            if (reversed)
+            {
+                position = 2.0 * boundary - position;
+                zoneReversed[z] = false;
+            }
+            else if (zone.loop == rmpZone::Loop::forward)
+                position -= (double)(zone.loopEnd - zone.loopStart);
+            else
+            {
+                position = 2.0 * boundary - position;
+                zoneReversed[z] = true;
+            }
+            continue;
+        }
+        const int count = jmin(numFrames - done, maxRun, jmax(1, (int)std::ceil(distance / step)));
+        mixFrames(z, level, position, reversed ? -step : step, count, destStart + done);
+        position += (reversed ? -step : step) * count;
+        done += count;
+    }
+    return done;
+}
+
+void LayerVoice::mixFrames(int z, int level, double position, double step, int numFrames, int destStart)
+{
+    const rmpZone &zone = *zones[z];
+    const double scale = 1.0 / (double)(1 << level);
+    const double start = position * scale, increment = step * scale;
+    const double end = start + increment * (numFrames - 1);
+    // frames around the run, one before and two after for the 4-point kernel
+    const int first = (int)std::floor(jmin(start, end)) - 1;
+    const int span = (int)std::floor(jmax(start, end)) + 3 - first;
+    jassert(span <= rmpZoneData::readChunk);
+    float window[rmpZoneData::readChunk];
+
+    for (int channel = 0; channel < aftereffect.getNumChannels(); ++channel)
+    {
+        readWindow(z, level, jmin(channel, zone.sample->getLevel(level).getNumChannels() - 1), first, span, window);
+        const float gain = zoneGains[z] * zone.channelGains[jmin(channel, 1)];
+        float *dest = aftereffect.getWritePointer(channel, destStart);
+        double offset = start - first;
+        for (int i = 0; i < numFrames; ++i, offset += increment)
+        {
+            // Catmull-Rom between x[1] and x[2]
+            const int index = jlimit(1, span - 3, (int)offset);
+            const float t = (float)(offset - index);
+            const float *x = window + index - 1;
+            dest[i] += gain * (x[1] + 0.5f * t * (x[2] - x[0]
+                + t * (2.0f * x[0] - 5.0f * x[1] + 4.0f * x[2] - x[3]
+                + t * (3.0f * (x[1] - x[2]) + x[3] - x[0]))));
+        }
+    }
+}
+
+void LayerVoice::readWindow(int z, int level, int channel, int first, int numFrames, float *dest)
+{
+    const rmpZone &zone = *zones[z];
+    const rmpZoneData &data = zone.sample->getLevel(level);
+    auto readRun = [&](int start, int count, float *out) {
+        if (const float *source = data.getFloatPointer(channel, start))
+            memcpy(out, source, (size_t)count * sizeof(float));
+        else if (data.isCompressed())
+            decoders[z].read(data, channel, start, count, out);
+        else
+            data.read(channel, start, count, out);
+    };
+
+    // once inside a loop, frames past its ends come from where the playback continues
+    const bool inLoop = zone.loop != rmpZone::Loop::none && zonePositions[z] >= zone.loopStart;
+    const double scale = 1.0 / (double)(1 << level);
+    const int loopStart = roundToInt(zone.loopStart * scale);
+    const int loopEnd = roundToInt(zone.loopEnd * scale);
+    const int turn = roundToInt((zone.loopEnd - 1) * scale);
+    int lowest = 0, highest = data.getNumSamples() - 1;
+    if (inLoop && zone.loop == rmpZone::Loop::forward)
+        highest = jmin(highest, loopEnd - 1);
+    else if (inLoop)
+    {
+        lowest = loopStart;
+        highest = jmin(highest, turn);
+    }
+
+    if (first >= lowest && first + numFrames - 1 <= highest)
+    {
+        readRun(first, numFrames, dest);
+        return;
+    }
+    for (int i = 0; i < numFrames; ++i)
+    {
+        int frame = first + i;
+        if (inLoop && zone.loop == rmpZone::Loop::forward && frame >= loopEnd)
+            frame -= jmax(1, loopEnd - loopStart);
+        else if (inLoop && zone.loop == rmpZone::Loop::pingPong)
+            frame = frame > turn ? 2 * turn - frame : (frame < loopStart ? 2 * loopStart - frame : frame);
+        if (frame >= 0 && frame < data.getNumSamples())
+            readRun(frame, 1, dest + i);
+        else
+            dest[i] = 0.0f;
     }
 }
 
@@ -147,37 +597,36 @@ void SummedVoice::noteOn(int midiChannel, int midiNoteNumber, float velocity)
     currentlyPlayingNote = midiNoteNumber;
     currentlyPlayingVelocity = velocity;
     currentSamplePosition = 0;
+    lifecycle.post(rmpVoiceLifecycle::Event::noteOn);
+    lifecycle.post(rmpVoiceLifecycle::Event::attackFinished);
+    activeLayers = 0;
     for (auto it = layerVoices.begin(); it != layerVoices.end(); ++it)
+    {
         (*it)->noteOn(midiChannel, midiNoteNumber, velocity);
-    sendToListenersAboutStart();
-
+        if ((*it)->isVoiceActive())
+            ++activeLayers;
+    }
+    if (activeLayers == 0)
+        clearNote();
 }
 
 void SummedVoice::noteOff(bool forced)
 {
-    if (askListenersForRelease() || forced)
-    {
-        for (auto it = layerVoices.begin(); it != layerVoices.end(); ++it)
-            (*it)->noteOff(forced);
-        refreshPlayingStatus();
-    }
+    if (!isVoiceActive())
+        return;
+    lifecycle.post(rmpVoiceLifecycle::Event::noteOff);
+    for (auto it = layerVoices.begin(); it != layerVoices.end(); ++it)
+        (*it)->noteOff(forced);
 };
 
-void SummedVoice::refreshPlayingStatus()
+void SummedVoice::layerFinished()
 {
-    bool status = false;
-    for (auto voice = layerVoices.begin(); voice != layerVoices.end(); ++voice)
-        if ((*voice)->isVoiceActive())
-            status = true;
-
-    if (!status)
-    {
-        currentPlayingMidiChannel = 0;
-        currentlyPlayingNote = -1;
-        currentlyPlayingVelocity = 0;
-        currentSamplePosition = 0;
-        askListenersForRelease();
-    }
+    if (--activeLayers > 0)
+        return;
+    lifecycle.post(rmpVoiceLifecycle::Event::finished);
+    if (synth)
+        synth->voiceFinished(this);
+    clearNote();
 }
 
 void SummedVoice::renderNextBlock (AudioBuffer<float>& outputBuffer, int startSample, int numSamples)
@@ -193,18 +642,53 @@ LayerVoice *SummedVoice::findVoice(LayerSound *ofSound)
     throw;
 }
 
+void rmpSynth::indexVoices()
+{
+    const ScopedLock sl(lock);
+    for (int note = 0; note < 128; ++note)
+        for (int channel = 0; channel < 16; ++channel)
+            activeVoices[note][channel] = nullptr;
+    activeList.clear();
+    activeList.reserve(voices.size());
+    freeVoices.clear();
+    freeVoices.reserve(voices.size());
+    for (auto voice = voices.begin(); voice != voices.end(); ++voice)
+    {
+        voice->get()->synth = this;
+        voice->get()->activeIndex = -1;
+        freeVoices.push_back(voice->get());
+    }
+    if (sound)
+        sound->refreshCoverage();
+}
+
 void rmpSynth::noteOn(const int midiChannel, const int midiNoteNumber, const float velocity)
 {
+    if (!acceptingNotes.load(std::memory_order_relaxed))
+        return;
     const ScopedLock sl(lock);
     if (sound->appliesToNoteAndVelocity(midiNoteNumber, velocity) && sound->appliesToChannel(midiChannel))
     {
-        for (auto voice = voices.begin(); voice != voices.end(); ++voice)
-            if (voice->get()->getCurrentlyPlayingNote() == midiNoteNumber && voice->get()->isPlayingChannel(midiChannel))
-                voice->get()->noteOff(true);
+        SummedVoice *&slot = activeVoices[midiNoteNumber][(midiChannel - 1) & 15];
+        if (slot)
+            slot->noteOff(true);
 
         SummedVoice *current = findFreeVoice(midiChannel, midiNoteNumber, isNoteStealingEnabled());
         if (current)
+        {
             current->noteOn(midiChannel, midiNoteNumber, velocity);
+            if (current->isVoiceActive())
+            {
+                // a new note starts at the channel's current bend instead of gliding to it
+                current->setPitch(channelPitch(midiChannel), true);
+                current->setVibrato(vibratoRate, channelVibratoDepth(midiChannel));
+                slot = current;
+                current->activeIndex = (int)activeList.size();
+                activeList.push_back(current);
+            }
+            else
+                freeVoices.push_back(current);
+        }
     }
 }
 
@@ -212,18 +696,61 @@ void rmpSynth::noteOff(const int midiChannel, const int midiNoteNumber, const fl
 {
     const ScopedLock sl(lock);
 
-    for (auto voice = voices.begin(); voice != voices.end(); ++voice)
-    {
-        if (voice->get()->getCurrentlyPlayingNote() == midiNoteNumber && voice->get()->isPlayingChannel(midiChannel))
-            voice->get()->noteOff(false);
-    }
+    SummedVoice *voice = activeVoices[midiNoteNumber][(midiChannel - 1) & 15];
+    if (voice)
+        voice->noteOff(false);
+}
+
+void rmpSynth::voiceFinished(SummedVoice *voice)
+{
+    if (voice->activeIndex < 0)
+        return;
+    SummedVoice *&slot = activeVoices[voice->getCurrentlyPlayingNote()][(voice->currentPlayingMidiChannel - 1) & 15];
+    if (slot == voice)
+        slot = nullptr;
+
+    // swap-remove, anyone walking activeList backwards has already visited the moved voice
+    SummedVoice *last = activeList.back();
+    activeList[voice->activeIndex] = last;
+    last->activeIndex = voice->activeIndex;
+    activeList.pop_back();
+    voice->activeIndex = -1;
+    freeVoices.push_back(voice);
 }
 
 void rmpSynth::reset()
 {
     const ScopedLock sl(lock);
+    for (int i = (int)activeList.size() - 1; i >= 0; --i)
+        if (i < (int)activeList.size())
+            activeList[i]->noteOff(true);
+}
+
+void rmpSynth::setCurrentPlaybackSampleRate(double rate)
+{
+    const ScopedLock sl(lock);
+    if (rate == sampleRate)
+        return;
+    sampleRate = rate;
+    if (sound)
+    {
+        if (sound->rack)
+            sound->rack->setSampleRate(rate);
+        for (auto layer = sound->layerSounds.begin(); layer != sound->layerSounds.end(); ++layer)
+            if ((*layer)->rack)
+                (*layer)->rack->setSampleRate(rate);
+    }
     for (auto voice = voices.begin(); voice != voices.end(); ++voice)
-        voice->get()->noteOff(true);
+    {
+        if ((*voice)->rack)
+            (*voice)->rack->setSampleRate(rate);
+        for (auto layer = (*voice)->layerVoices.begin(); layer != (*voice)->layerVoices.end(); ++layer)
+        {
+            (*layer)->setCurrentPlaybackSampleRate(rate);
+            if ((*layer)->rack)
+                (*layer)->rack->setSampleRate(rate);
+        }
+    }
 }
 
 void rmpSynth::turnOff()
@@ -231,6 +758,73 @@ void rmpSynth::turnOff()
     turnedOff = 0;
 }
 
+bool rmpSynth::isSounding()
+{
+    if (!activeList.empty())
+        return true;
+    if (!sound)
+        return false;
+    if (sound->rack->hasTail())
+        return true;
+    for (auto layerSound = sound->layerSounds.begin(); layerSound != sound->layerSounds.end(); ++layerSound)
+        if ((*layerSound)->rack->hasTail())
+            return true;
+    return false;
+}
+
+bool rmpSynth::releaseSome()
+{
+    // the voices go first, they unpin the recordings of the layers
+    if (!voices.empty())
+    {
+        activeList.clear();
+        freeVoices.clear();
+        voices.pop_back();
+        return true;
+    }
+    if (sound && !sound->layerSounds.empty())
+    {
+        sound->layerSounds.pop_back();
+        return true;
+    }
+    if (sound)
+    {
+        sound.reset();
+        return true;
+    }
+    // the objects in the arena are not freed one by one, its blocks all go in this last step
+    if (arena)
+    {
+        arena.reset();
+        return true;
+    }
+    return false;
+}
+
+size_t rmpSynth::getResidentBytes() const
+{
+    size_t bytes = arena ? arena->getReservedBytes() : 0;
+    // a recording used by several layers counts once
+    std::unordered_set<const rmpSample *> counted;
+    if (sound)
+        for (auto layer = sound->layerSounds.begin(); layer != sound->layerSounds.end(); ++layer)
+            bytes += (*layer)->getSampleBytes(counted);
+    return bytes;
+}
+
+String rmpSynth::describeStorage() const
+{
+    String report;
+    if (sound)
+        for (auto layer = sound->layerSounds.begin(); layer != sound->layerSounds.end(); ++layer)
+            report << (*layer)->describeStorage() << "\n";
+    if (arena)
+        report << "objects: " << String((double)arena->getUsedBytes() / 1024.0, 1) << " KB in "
+            << String(arena->getNumBlocks()) << " blocks of " << String((double)arena->getReservedBytes() / 1024.0, 1) << " KB\n";
+    report << SharedResourcePointer<rmpSampleArena>()->describe() << "\n";
+    return report;
+}
+
 void rmpSynth::renderNextBlock(AudioBuffer<float>& outputAudio, const MidiBuffer& midiData, int startSample, int numSamples)
 {
     if (turnedOff)
@@ -263,7 +857,7 @@ void rmpSynth::renderNextBlock(AudioBuffer<float>& outputAudio, const MidiBuffer
             if (targetChannels > 0)
                 renderVoices(outputAudio, startSample, numSamples);
 
-            handleMidiEvent(m);
+            // later events belong to the next range, the processor splits a block at a program change
             break;
         }
 
@@ -282,23 +876,35 @@ void rmpSynth::renderNextBlock(AudioBuffer<float>& outputAudio, const MidiBuffer
         startSample += samplesToNextMidiMessage;
         numSamples -= samplesToNextMidiMessage;
     }
-    while (midiIterator.getNextEvent(m, midiEventPos))
-        handleMidiEvent(m);
 }
 
 void rmpSynth::renderVoices(AudioBuffer<float>& buffer, int startSample, int numSamples)
 {
-    AudioBuffer<float> soundsumBuffer(buffer.getNumChannels(), buffer.getNumSamples());
-    soundsumBuffer.clear();
-    AudioBuffer<float> layersumBuffer(buffer.getNumChannels(), buffer.getNumSamples());
+    soundsumBuffer.setSize(buffer.getNumChannels(), buffer.getNumSamples(), false, false, true);
+    layersumBuffer.setSize(buffer.getNumChannels(), buffer.getNumSamples(), false, false, true);
+    bool soundHasInput = false;
     for (auto layerSound = sound->layerSounds.begin(); layerSound != sound->layerSounds.end(); ++layerSound)
     {
-        layersumBuffer.clear();
-        for (auto sumVoice = voices.begin(); sumVoice != voices.end(); ++sumVoice)
+        // an idle layer whose rack has no tail left would only add silence
+        bool layerHasInput = false;
+        for (auto sumVoice = activeList.begin(); sumVoice != activeList.end() && !layerHasInput; ++sumVoice)
+            if ((*sumVoice)->findVoice(layerSound->get())->isVoiceActive())
+                layerHasInput = true;
+        if (!layerHasInput && !layerSound->get()->rack->hasTail())
+            continue;
+
+        if (!soundHasInput)
+            soundsumBuffer.clear(startSample, numSamples);
+        soundHasInput = true;
+
+        layersumBuffer.clear(startSample, numSamples);
+        // backwards, since a voice that finishes while rendering leaves activeList
+        for (int i = (int)activeList.size() - 1; i >= 0; --i)
         {
-            LayerVoice *layerVoice = sumVoice->get()->findVoice(layerSound->get());
+            LayerVoice *layerVoice = activeList[i]->findVoice(layerSound->get());
+            if (!layerVoice->isVoiceActive())
+                continue;
             layerVoice->renderNextBlock(layersumBuffer, startSample, numSamples);
-            sumVoice->get()->refreshPlayingStatus();
         }
         layerSound->get()->rack->applyOn(layersumBuffer, startSample, numSamples);
         
@@ -319,6 +925,12 @@ void rmpSynth::renderVoices(AudioBuffer<float>& buffer, int startSample, int num
             soundsumBuffer.addFrom(0, startSample, layersumBuffer, 1, startSample, numSamples, 0.5);
         }
     }
+    if (!soundHasInput)
+    {
+        if (!sound->rack->hasTail())
+            return;
+        soundsumBuffer.clear(startSample, numSamples);
+    }
     sound->rack->applyOn(soundsumBuffer, startSample, numSamples);
     
     if (soundsumBuffer.getNumChannels() > 1 && buffer.getNumChannels() > 1)
@@ -339,6 +951,58 @@ void rmpSynth::renderVoices(AudioBuffer<float>& buffer, int startSample, int num
     }
 }
 
+float rmpSynth::channelPitch(int midiChannel) const
+{
+    const auto wheelSemitones = [this](int channel, float range) {
+        return (float)(lastPitchWheelValues[channel - 1] - 8192) / 8192.0f * range;
+    };
+    if (mpeBendRange <= 0.0f)
+        return wheelSemitones(midiChannel, pitchBendRange);
+    // MPE: the master channel bends the whole zone, a member channel only its own note
+    if (midiChannel == 1)
+        return wheelSemitones(1, pitchBendRange);
+    return wheelSemitones(midiChannel, mpeBendRange) + wheelSemitones(1, pitchBendRange);
+}
+
+float rmpSynth::channelVibratoDepth(int midiChannel) const
+{
+    float modulation = modWheelValues[midiChannel - 1];
+    if (mpeBendRange > 0.0f)
+        modulation = jmax(modulation, modWheelValues[0]);
+    return modulation * vibratoDepth;
+}
+
+void rmpSynth::updateModulation(int midiChannel, bool pitchChanged)
+{
+    // with MPE the master channel reaches every note
+    const bool allChannels = mpeBendRange > 0.0f && midiChannel == 1;
+    for (auto voice = activeList.begin(); voice != activeList.end(); ++voice)
+    {
+        const int voiceChannel = (*voice)->getChannel();
+        if (!allChannels && voiceChannel != midiChannel)
+            continue;
+        if (pitchChanged)
+            (*voice)->setPitch(channelPitch(voiceChannel), false);
+        else
+            (*voice)->setVibrato(vibratoRate, channelVibratoDepth(voiceChannel));
+    }
+}
+
+void rmpSynth::handlePitchWheel(int midiChannel, int)
+{
+    const ScopedLock sl(lock);
+    updateModulation(midiChannel, true);
+}
+
+void rmpSynth::handleController(int midiChannel, int controllerNumber, int controllerValue)
+{
+    if (controllerNumber != 1)
+        return;
+    const ScopedLock sl(lock);
+    modWheelValues[midiChannel - 1] = (float)controllerValue / 127.0f;
+    updateModulation(midiChannel, false);
+}
+
 void rmpSynth::handleMidiEvent(const MidiMessage& m)
 {
     const int channel = m.getChannel();
@@ -353,8 +1017,9 @@ void rmpSynth::handleMidiEvent(const MidiMessage& m)
     }
     else if (m.isAllNotesOff() || m.isAllSoundOff())
     {
-        for (auto voice = voices.begin(); voice != voices.end(); ++voice)
-            voice->get()->noteOff(false);
+        for (int i = (int)activeList.size() - 1; i >= 0; --i)
+            if (i < (int)activeList.size())
+                activeList[i]->noteOff(false);
     }
     else if (m.isPitchWheel())
     {
@@ -383,9 +1048,12 @@ void rmpSynth::handleMidiEvent(const MidiMessage& m)
 SummedVoice* rmpSynth::findFreeVoice(int midiChannel, int midiNoteNumber, bool stealIfNoneAvailable)
 {
     const ScopedLock sl(lock);
-    for (auto voice = voices.begin(); voice != voices.end(); ++voice)
-        if (!voice->get()->isVoiceActive())
-            return voice->get();
+    if (!freeVoices.empty())
+    {
+        SummedVoice *voice = freeVoices.back();
+        freeVoices.pop_back();
+        return voice;
+    }
 
     if (stealIfNoneAvailable)
         return findVoiceToSteal(midiChannel, midiNoteNumber);
@@ -5,18 +5,28 @@
 #include <list>
 #include "EffectRack.h"
 #include <algorithm>
-#include "StartStopBroadcaster.h"
+#include "VoiceLifecycle.h"
 #include "SQLInputSource.h"
+#include "ZoneData.h"
+#include "SampleManager.h"
+#include "SmoothedParam.h"
+#include "ObjectArena.h"
 #include <unordered_set>
+#include <bitset>
+#include <atomic>
 
 struct soundBox {
     uint8 mainNote, lowestNote, highestNote;
     uint8 mainVel, lowestVel, highestVel;
     String transposeMethod;
-    void *soundfile_data;
-    size_t soundfile_size;
+    // loop points and crossfade length in frames of the source file, loopMode is "forward" or "pingpong"
+    String loopMode;
+    int loopStart = 0, loopEnd = 0, loopCrossfade = 0;
+    // -1 is hard left, 1 hard right
+    float pan = 0.0f;
+    // the file is read from the pack when no instrument in the process has it loaded yet
+    String soundfile, database;
     soundBox() = default;
-    ~soundBox() { free(soundfile_data); }
 };
 
 class rmpSound
@@ -30,6 +40,39 @@ public:
     virtual bool appliesToNote(int midiNoteNumber) = 0;
     virtual bool appliesToNoteAndVelocity(int midiNoteNumber, float velocity) = 0;
     virtual bool appliesToChannel(int midiChannel) = 0;
+
+    /** Maps a 0..1 velocity onto the 128 velocity cells, full velocity included. */
+    static int velocityIndex(float velocity) { return jlimit(0, 127, int(velocity * 128)); };
+
+    typedef std::bitset<128 * 128> Coverage;
+    static int coverageIndex(int midiNoteNumber, int velocityCell) { return midiNoteNumber * 128 + velocityCell; };
+};
+
+/** One immutable recording in a layer, the key/velocity region it answers for and the rate
+    it is played at there. Positions are in frames of the recording's level 0. */
+struct rmpZone
+{
+    enum class Loop : uint8 { none, forward, pingPong };
+
+    uint8 lowestNote, highestNote;
+    uint8 lowestVel, highestVel;
+    Loop loop = Loop::none;
+    int loopStart = 0, loopEnd = 0;
+    // silent frames trimmed from the head of the recording, played back as a delay to keep the timing
+    int startDelay = 0;
+    // left and right gains, a mono zone feeds both output channels through them
+    float channelGains[2] = { 1.0f, 1.0f };
+    // playback rate relative to the recording before any bend or sample rate conversion
+    double rate = 1.0;
+    std::shared_ptr<const rmpSample> sample;
+};
+
+/** The zones sounding together in one note and velocity cell. */
+struct rmpZoneSet
+{
+    static const int maxZones = 4;
+    uint8 numZones;
+    uint16 zones[maxZones];
 };
 
 class LayerSound : public rmpSound
@@ -44,24 +87,50 @@ public:
     bool appliesToNoteAndVelocity(int midiNoteNumber, float velocity);
     bool appliesToChannel (int midiChannel) override;
 
-    std::shared_ptr< AudioBuffer<float> > getData(int currentMidiNoteNumber, float currentVelocity) 
-    {
-        return fullData[currentMidiNoteNumber][int(currentVelocity*128)]; 
-    };
-    int getDataLength(int midiNoteNumber, float velocity) 
-    {
-        return (fullData[midiNoteNumber][int(velocity * 128)]) ? fullData[midiNoteNumber][int(velocity * 128)]->getNumSamples() : 0;
-    };
+    /** How overlapping velocity ranges blend: added as they are, or crossfaded across the overlap. */
+    enum class Crossfade { sum, linear, equalPower };
+
+    /** Fills in the zones that play the note at this velocity with their crossfade gains,
+        and returns how many there are (0 if the layer is silent there). */
+    int getZones(int midiNoteNumber, float velocity, const rmpZone **zonesOut, float *gainsOut) const;
+    int getNumZones() const { return (int)zones.size(); };
+    bool isCompressed() const { return storage == "compressed"; };
+    /** Memory and decoding cost of the zones, one line for the log. */
+    String describeStorage() const;
+    /** Resident size of the recordings not in counted yet, which are added to it. */
+    size_t getSampleBytes(std::unordered_set<const rmpSample *> &counted) const;
+    const Coverage &getCoverage() const { return coverage; };
 
     std::shared_ptr<rmpEffectRack> rack;
 protected:
     friend class InstrBuilder;
-    void appendBox(soundBox &tempBox, float hostSampleRate);
-    void resample(AudioBuffer<float> &base, AudioBuffer<float> &resampled, float ratio);
+    /** Fails when the file of the box cannot be read from the pack, or when the box would
+        stack more than rmpZoneSet::maxZones zones on one cell. */
+    Result appendBox(soundBox &tempBox, float hostSampleRate);
+    /** Maps the recording of a box from the sample store, or decodes and trims it from the
+        pack. Returns nullptr if the pack does not hold it. */
+    std::shared_ptr<rmpSample> loadSample(const soundBox &tempBox, const String &key, float hostSampleRate);
+    /** The forward loop of a box in frames of the trimmed recording, false if it has none. */
+    static bool findForwardLoop(const soundBox &tempBox, int trimStart, int length, int &loopStart, int &loopEnd);
 	void clear();
+    uint16 addZone(const rmpZone &zone);
+    /** Finds the frames between the first and the last one reaching the threshold on any channel. */
+    static void findAudibleRange(const AudioBuffer<float> &data, float threshold, int &start, int &end);
+    static void bakeLoopCrossfade(AudioBuffer<float> &data, int loopStart, int loopEnd, int crossfadeLength);
+    float crossfadeGain(const rmpZone &zone, const rmpZoneSet &set, int velocityCell) const;
 
     String name;
-	std::shared_ptr< AudioBuffer<float> > fullData[128][128];
+    Crossfade crossfade = Crossfade::sum;
+    // sample format of the zones, see rmpZoneData::formatFor
+    String storage = "float";
+    // peak level under which the head and tail of recordings are dropped at load, 0 keeps them
+    float trimThreshold = 0.0f;
+    SharedResourcePointer<rmpSampleManager> sampleManager;
+    std::vector<rmpZone> zones;
+    std::vector<rmpZoneSet> zoneSets;
+    // index into zoneSets plus one for every note and velocity cell, 0 where nothing plays
+    uint16 zoneMap[128][128] = {};
+    Coverage coverage;
 };
 
 class SummedSound : public rmpSound {
@@ -71,17 +140,22 @@ public:
 
     bool appliesToNote(int midiNoteNumber)
     {
-        for (auto it = layerSounds.begin(); it != layerSounds.end(); ++it)
-            if ((*it)->appliesToNote(midiNoteNumber))
-                return true;
-        return false;
+        return noteCoverage[midiNoteNumber];
     }
     bool appliesToNoteAndVelocity(int midiNoteNumber, float velocity)
     {
+        return coverage[coverageIndex(midiNoteNumber, velocityIndex(velocity))];
+    }
+    /** Rebuilds the union of the layers' coverage, must follow any change to the layers. */
+    void refreshCoverage()
+    {
+        coverage.reset();
         for (auto it = layerSounds.begin(); it != layerSounds.end(); ++it)
-            if ((*it)->appliesToNoteAndVelocity(midiNoteNumber, velocity))
-                return true;
-        return false;
+            coverage |= (*it)->getCoverage();
+        noteCoverage.reset();
+        for (int note = 0; note < 128; ++note)
+            for (int vel = 0; vel < 128 && !noteCoverage[note]; ++vel)
+                noteCoverage[note] = coverage[coverageIndex(note, vel)];
     }
     bool appliesToChannel(int midiChannel)
     {
@@ -95,10 +169,12 @@ public:
     std::list<std::shared_ptr<LayerSound>> layerSounds;
 protected:
     String name;
+    Coverage coverage;
+    std::bitset<128> noteCoverage;
 };
 
 
-class rmpVoice : public StartStopBroadcaster
+class rmpVoice
 {
 public:
     rmpVoice(rmpSound &_sound) : sound(_sound) {};
@@ -113,7 +189,7 @@ public:
     virtual void noteOff(bool forced) = 0;
 
     bool isVoiceActive() const { return currentlyPlayingNote >= 0; };
-    void reactOnDelayedStop() { noteOff(false); };
+    rmpVoiceLifecycle::State getState() const noexcept { return lifecycle.getState(); }
 
     virtual void pitchWheelMoved(int newPitchWheelValue) {};
     virtual void controllerMoved(int controllerNumber, int newControllerValue) {};
@@ -133,7 +209,17 @@ public:
     void setSostenutoPedalDown(bool isNowDown) noexcept { sostenutoPedalDown = isNowDown; }
 
 protected:
+    void clearNote()
+    {
+        currentPlayingMidiChannel = 0;
+        currentlyPlayingNote = -1;
+        currentlyPlayingVelocity = 0;
+        currentSamplePosition = 0;
+        lifecycle.reset();
+    };
+
     rmpSound &sound;
+    rmpVoiceLifecycle lifecycle;
     double currentSampleRate = 44100.0;
     int currentlyPlayingNote = -1, currentPlayingMidiChannel = 0, currentSamplePosition = 0;
     float currentlyPlayingVelocity = 0;
@@ -141,6 +227,8 @@ protected:
     friend class InstrBuilder;
 };
 
+class SummedVoice;
+
 class LayerVoice : public rmpVoice
 {
 public:
@@ -149,7 +237,7 @@ public:
         aftereffect.setSize(2, 256);
 
     };
-    ~LayerVoice() = default;
+    ~LayerVoice() { releaseZones(); };
     LayerVoice(LayerVoice &) = default;
     LayerVoice(LayerVoice &&) = default;
 
@@ -159,18 +247,71 @@ public:
 
     void repairRackLinks()
     {
-        clearListeners();
-        StartStopBroadcaster::Listener *adsr = dynamic_cast<StartStopBroadcaster::Listener *>(rack->findEffect("adsr"));
-        if (adsr)
-            addListener(adsr);
+        envelope = dynamic_cast<rmpADSR *>(rack->findEffect("adsr"));
+        if (envelope)
+            envelope->bind(&lifecycle);
+    };
+    void setOwner(SummedVoice *_owner) { owner = _owner; };
+    void setCurrentPlaybackSampleRate(double newRate) override
+    {
+        currentSampleRate = newRate;
+        pitch.reset(newRate, 0.02);
+        vibratoIncrement = MathConstants<double>::twoPi * vibratoRate / newRate;
+    };
+
+    /** Bend in semitones from the pitch wheel or MPE, ramped unless the note just started. */
+    void setPitch(float semitones, bool immediately)
+    {
+        if (immediately)
+            pitch.setCurrentAndTargetValue(semitones);
+        else
+            pitch.setTargetValue(semitones);
+    };
+    void setVibrato(float rateHz, float depthSemitones)
+    {
+        vibratoRate = rateHz;
+        vibratoDepth = depthSemitones;
+        vibratoIncrement = MathConstants<double>::twoPi * vibratoRate / currentSampleRate;
+    };
+    /** Gives every zone slot a decode ring, needed when the layer stores compressed zones. */
+    void allocateDecoders()
+    {
+        for (int z = 0; z < rmpZoneSet::maxZones; ++z)
+            decoders[z].allocate(2);
     };
 
     std::shared_ptr<rmpEffectRack> rack;
 protected:
+    void finish();
+    /** Unpins the recordings of the playing zones. */
+    void releaseZones();
+    int mixZone(int z, int destStart, int numFrames, double rateScale);
+    void mixFrames(int z, int level, double position, double step, int numFrames, int destStart);
+    void readWindow(int z, int level, int channel, int first, int numFrames, float *dest);
+
+    /** Frames between playback rate updates while the pitch moves. */
+    static const int modulationInterval = 32;
+
+    const rmpZone *zones[rmpZoneSet::maxZones];
+    float zoneGains[rmpZoneSet::maxZones];
+    double zonePositions[rmpZoneSet::maxZones];
+    bool zoneReversed[rmpZoneSet::maxZones];
+    bool zonePinned[rmpZoneSet::maxZones];
+    // the longest start delay of the playing zones, nothing is audible before it
+    int startDelay = 0;
+    rmpZoneDecoder decoders[rmpZoneSet::maxZones];
+    int numZones = 0;
+    rmpSmoothedParam pitch { rmpSmoothedParam::Ramp::linear };
+    float vibratoRate = 5.0f, vibratoDepth = 0.0f;
+    double vibratoPhase = 0.0, vibratoIncrement = 0.0;
     AudioBuffer<float> aftereffect;
+    rmpADSR *envelope = nullptr;
+    SummedVoice *owner = nullptr;
 
 };
 
+class rmpSynth;
+
 class SummedVoice : public rmpVoice
 {
 public:
@@ -181,21 +322,37 @@ public:
     void noteOn(int midiChannel, int midiNoteNumber, float velocity) override;
     void noteOff(bool forced) override;
 
-    void refreshPlayingStatus();
+    /** Called by a layer voice that has just finished, the last one finishes this voice. */
+    void layerFinished();
+
+    void setPitch(float semitones, bool immediately)
+    {
+        for (auto voice = layerVoices.begin(); voice != layerVoices.end(); ++voice)
+            voice->get()->setPitch(semitones, immediately);
+    };
+    void setVibrato(float rateHz, float depthSemitones)
+    {
+        for (auto voice = layerVoices.begin(); voice != layerVoices.end(); ++voice)
+            voice->get()->setVibrato(rateHz, depthSemitones);
+    };
+    int getChannel() const noexcept { return currentPlayingMidiChannel; }
 
     void renderNextBlock(AudioBuffer<float> &outputBuffer, int startSample, int numSamples) override;
 
     LayerVoice *findVoice(LayerSound *ofSound);
     void repairRackLinks()
     {
-        clearListeners();
-        StartStopBroadcaster::Listener *adsr = dynamic_cast<StartStopBroadcaster::Listener *>(rack->findEffect("adsr"));
-        if (adsr)
-            addListener(adsr);
+        for (auto voice = layerVoices.begin(); voice != layerVoices.end(); ++voice)
+            voice->get()->setOwner(this);
     };
 
     std::shared_ptr<rmpEffectRack> rack;
     std::list<std::shared_ptr<LayerVoice>> layerVoices;
+protected:
+    friend class rmpSynth;
+    rmpSynth *synth = nullptr;
+    int activeLayers = 0;
+    int activeIndex = -1;
 };
 
 class rmpSynth
@@ -205,11 +362,23 @@ public:
     {
         soundsumBuffer.setSize(2, 256);
         layersumBuffer.setSize(2, 256);
+        for (int channel = 0; channel < 16; ++channel)
+        {
+            lastPitchWheelValues[channel] = 8192;
+            modWheelValues[channel] = 0.0f;
+        }
+        indexVoices();
     }
     ~rmpSynth() = default;
     rmpSynth(rmpSynth &&) = default;
 
-    void clearVoices() { return voices.clear(); };
+    void clearVoices()
+    {
+        voices.clear();
+        indexVoices();
+    };
+    /** Rebuilds the free list and the note index, must follow any change to the voice pool. */
+    void indexVoices();
     int getNumVoices() const noexcept { return voices.size(); }
     
     SummedSound *getSound()
@@ -224,20 +393,34 @@ public:
     void noteOff(int midiChannel, int midiNoteNumber, float velocity);
     void reset();
 
-    void handlePitchWheel(int midiChannel, int wheelValue) {};
-    void handleController(int midiChannel, int controllerNumber, int controllerValue) {};
+    void handlePitchWheel(int midiChannel, int wheelValue);
+    void handleController(int midiChannel, int controllerNumber, int controllerValue);
     void handleAftertouch(int midiChannel, int midiNoteNumber, int aftertouchValue) {};
     void handleChannelPressure(int midiChannel, int channelPressureValue) {};
     void handleSustainPedal(int midiChannel, bool isDown) {};
     void handleSostenutoPedal(int midiChannel, bool isDown) {};
     void handleSoftPedal(int midiChannel, bool isDown) {};
+    // program changes switch between the synths the processor keeps resident
     void handleProgramChange(int midiChannel, int programNumber) {};
 
-    void setCurrentPlaybackSampleRate(double rate) { sampleRate = rate; };
+    /** Retunes voices and effects to a new host rate, the recordings themselves are untouched. */
+    void setCurrentPlaybackSampleRate(double rate);
     double getSampleRate() const noexcept { return sampleRate; }
 
     void renderNextBlock(AudioBuffer<float>& outputAudio, const MidiBuffer& inputMidi, int startSample, int numSamples);
     void turnOff();
+    /** Ignoring note-ons lets a synth fading out after a swap or a program change only play
+        the notes it already holds and its tails. Note-offs still reach them. */
+    void setAcceptingNotes(bool shouldAccept) noexcept { acceptingNotes = shouldAccept; }
+    /** True while a voice or an effect tail would still produce sound, audio thread only. */
+    bool isSounding();
+    String describeStorage() const;
+    /** Bytes held by the recordings and the objects of the synth, recordings shared with
+        other synths included. */
+    size_t getResidentBytes() const;
+    /** Frees one voice or one layer of a retired synth, so it can be taken apart in small
+        steps, and the arena of its objects last. Returns false once nothing is left. */
+    bool releaseSome();
 
     void setMinimumRenderingSubdivisionSize(int numSamples, bool shouldBeStrict = false) noexcept
     {
@@ -247,12 +430,37 @@ public:
 
     CriticalSection lock;
     bool turnedOff = false;
+    std::atomic<bool> acceptingNotes { true };
 protected:
 
     friend class InstrBuilder;
-    std::list<std::shared_ptr<SummedVoice>> voices;
+    friend class SummedVoice;
+    void voiceFinished(SummedVoice *voice);
+
+    // the voice sounding each note on each MIDI channel, nullptr when there is none
+    SummedVoice *activeVoices[128][16];
+    std::vector<SummedVoice *> activeList;
+    std::vector<SummedVoice *> freeVoices;
+
+    // holds the voices, sounds and racks, released when the last of them is gone
+    std::shared_ptr<rmpObjectArena> arena;
+    // the sound outlives the voices, which unpin its recordings when they go
     std::shared_ptr<SummedSound> sound;
+    std::list<std::shared_ptr<SummedVoice>> voices;
     int lastPitchWheelValues[16];
+    float modWheelValues[16];
+
+    /** Bend and vibrato depth in semitones for a note on this channel. */
+    float channelPitch(int midiChannel) const;
+    float channelVibratoDepth(int midiChannel) const;
+    void updateModulation(int midiChannel, bool pitchChanged);
+
+    // bend range of the wheel, with MPE on it is the range of the master channel 1
+    float pitchBendRange = 2.0f;
+    // bend range of the MPE member channels 2-16, 0 when MPE is off
+    float mpeBendRange = 0.0f;
+    // vibrato rate and its depth at full modulation wheel
+    float vibratoRate = 5.0f, vibratoDepth = 0.5f;
 
     AudioBuffer<float> soundsumBuffer;
     AudioBuffer<float> layersumBuffer;